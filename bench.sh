@@ -0,0 +1,16 @@
+#!/bin/sh
+#
+# Builds core/voxels.c natively with the host compiler alongside the
+# benchmark driver in bench/bench.c and runs it.
+# The results get printed to stdout as JSON, so you can do:
+# npm run bench > results.json
+#
+# Extra compiler flags can be passed through CFLAGS, the same as with make.sh:
+# CFLAGS="-DVOXELS_PALETTE=1" npm run bench
+# Any arguments select the scenarios to run (terrain, generate, sand). All of them by default.
+#
+CC=${CC:-clang}
+$CC -O3 -march=native \
+$CFLAGS \
+-o bench/bench bench/bench.c -lm -pthread || exit 1
+./bench/bench "$@"
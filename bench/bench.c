@@ -0,0 +1,543 @@
+// Native benchmark for the core/voxels.c kernels.
+// It includes the C implementation as is, runs a few fixed scenarios
+// and prints the per-kernel timings and throughputs as JSON.
+// Build and run it with: npm run bench (see bench.sh)
+
+#define _POSIX_C_SOURCE 199309L
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../core/voxels.c"
+
+typedef struct {
+  int width;
+  int height;
+  int depth;
+  World world;
+  ChunkSummary* summary;
+  int* heightmap;
+  Voxels* voxels;
+  unsigned char* pool;
+  int* queueData[2];
+  Queue queues[2];
+  unsigned int* dirty;
+  unsigned int* awake;
+  unsigned int chunks;
+  unsigned char* slice;
+} Bench;
+
+typedef struct {
+  unsigned int* indices;
+  unsigned char* vertices;
+  unsigned char* colors;
+  float bounds[4];
+} Output;
+
+static unsigned int seed = 0x9E3779B9;
+
+static const unsigned int random32() {
+  // xorshift32 so every run uses the exact same edits
+  seed ^= seed << 13;
+  seed ^= seed >> 17;
+  seed ^= seed << 5;
+  return seed;
+}
+
+static double now() {
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return time.tv_sec + time.tv_nsec * 1e-9;
+}
+
+static Bench* createBench(const int width, const int height, const int depth) {
+  Bench* bench = calloc(1, sizeof(Bench));
+  bench->width = width;
+  bench->height = height;
+  bench->depth = depth;
+  // Same as VoxelWorld, which always keeps the chunk summary
+  bench->chunks = (width / 32) * (height / 32) * (depth / 32);
+  bench->summary = calloc(bench->chunks, sizeof(ChunkSummary));
+  const World world = { width, height, depth, 32, bench->summary };
+  memcpy(&bench->world, &world, sizeof(World));
+  bench->heightmap = calloc(width * depth, sizeof(int));
+  const size_t voxels = (size_t) width * height * depth;
+#if VOXELS_PALETTE
+  // Same defaults as the VoxelWorld paletteMemory option
+  const size_t chunks = voxels / PALETTE_CHUNK_VOXELS;
+  bench->voxels = calloc(1, sizeof(Voxels) + chunks * sizeof(PaletteChunk));
+  bench->pool = malloc(voxels * 2);
+  *(unsigned char**) &bench->voxels->pool = bench->pool;
+  *(unsigned int*) &bench->voxels->poolSize = voxels * 2;
+#else
+  bench->voxels = calloc(voxels, VOXELS_STRIDE);
+#endif
+  // Same defaults as the VoxelWorld queueSize option
+  const unsigned int queueSize = width * depth * 2;
+  for (unsigned char i = 0; i < 2; i++) {
+    bench->queueData[i] = malloc(queueSize * sizeof(int));
+    const Queue queue = { bench->queueData[i], queueSize };
+    memcpy(&bench->queues[i], &queue, sizeof(Queue));
+  }
+  bench->dirty = calloc((bench->chunks + 31) / 32, sizeof(unsigned int));
+  bench->awake = malloc((bench->chunks + 31) / 32 * sizeof(unsigned int));
+  memset(bench->awake, 0xFF, (bench->chunks + 31) / 32 * sizeof(unsigned int));
+  bench->slice = malloc((size_t) width * height * VOXELS_STRIDE);
+  return bench;
+}
+
+static void destroyBench(Bench* bench) {
+  free(bench->summary);
+  free(bench->heightmap);
+  free(bench->voxels);
+  free(bench->pool);
+  free(bench->queueData[0]);
+  free(bench->queueData[1]);
+  free(bench->dirty);
+  free(bench->awake);
+  free(bench->slice);
+  free(bench);
+}
+
+static const unsigned int countDirty(Bench* bench) {
+  unsigned int count = 0;
+  for (unsigned int i = 0; i < (bench->chunks + 31) / 32; i++) {
+    count += __builtin_popcount(bench->dirty[i]);
+    bench->dirty[i] = 0;
+  }
+  return count;
+}
+
+static void printResult(
+  const char* name,
+  const Bench* bench,
+  const double seconds,
+  const char* unit,
+  const double count,
+  const char* extra
+) {
+  static unsigned char isFirst = 1;
+  printf(
+    "%s    { \"kernel\": \"%s\", \"world\": [%d, %d, %d], \"seconds\": %.6f, \"%s\": %.0f, \"%sPerSecond\": %.0f%s%s }",
+    isFirst ? "" : ",\n",
+    name,
+    bench->width, bench->height, bench->depth,
+    seconds,
+    unit,
+    count,
+    unit,
+    seconds > 0 ? count / seconds : 0,
+    extra ? ", " : "",
+    extra ? extra : ""
+  );
+  isFirst = 0;
+}
+
+static void meshAll(Bench* bench, Output* output, const unsigned char flags, const unsigned char lod, const char* name) {
+  const int chunksX = bench->width / 32,
+            chunksY = bench->height / 32,
+            chunksZ = bench->depth / 32;
+  unsigned long faces = 0;
+  const double start = now();
+  for (int z = 0; z < chunksZ; z++) {
+    for (int y = 0; y < chunksY; y++) {
+      for (int x = 0; x < chunksX; x++) {
+        faces += lod > 1 ? meshLOD(
+          &bench->world,
+          bench->voxels,
+          output->bounds,
+          output->indices,
+          output->vertices,
+          output->colors,
+          32,
+          x * 32, y * 32, z * 32,
+          lod,
+          flags
+        ) : mesh(
+          &bench->world,
+          bench->voxels,
+          output->bounds,
+          output->indices,
+          output->vertices,
+          output->colors,
+          32,
+          x * 32, y * 32, z * 32,
+          flags
+        );
+      }
+    }
+  }
+  const double seconds = now() - start;
+  char extra[64];
+  snprintf(extra, sizeof(extra), "\"chunks\": %u, \"chunksPerSecond\": %.0f", bench->chunks, bench->chunks / seconds);
+  printResult(name, bench, seconds, "faces", faces, extra);
+}
+
+#if !VOXELS_PALETTE
+// The threaded generation and light only run on the dense layouts (see runGenerate)
+typedef struct {
+  Bench* bench;
+  Queue* queue;
+  int fromZ;
+  int toZ;
+} Slab;
+
+static void* generateSlabThread(void* data) {
+  const Slab* slab = data;
+  generateSlab(
+    &slab->bench->world,
+    slab->bench->heightmap,
+    slab->bench->voxels,
+    1337,
+    0,
+    GENERATE_INTERPOLATED,
+    slab->fromZ,
+    slab->toZ
+  );
+  return 0;
+}
+
+static void* propagateColumnsThread(void* data) {
+  const Slab* slab = data;
+  propagateColumns(&slab->bench->world, slab->bench->voxels, slab->fromZ, slab->toZ);
+  return 0;
+}
+
+typedef struct {
+  Bench* bench;
+  Queue* queue;
+  int color;
+  int thread;
+  int threads;
+} SpillBatch;
+
+static void* propagateSpillThread(void* data) {
+  // Floods every threads-th tile of 32 x 32 columns of a color, from the thread-th one
+  const SpillBatch* batch = data;
+  Bench* bench = batch->bench;
+  for (int z = 0, tz = 0, i = 0; z < bench->depth; z += 32, tz++) {
+    for (int x = 0, tx = 0; x < bench->width; x += 32, tx++) {
+      if ((tz % 3) * 3 + (tx % 3) != batch->color || i++ % batch->threads != batch->thread) {
+        continue;
+      }
+      propagateSpill(
+        &bench->world, bench->heightmap, bench->voxels, batch->queue,
+        x, x + 32 < bench->width ? x + 32 : bench->width,
+        z, z + 32 < bench->depth ? z + 32 : bench->depth
+      );
+    }
+  }
+  return 0;
+}
+
+static void propagateThreads(Bench* bench, const int threads) {
+  // Same schedule as VoxelWorld.propagateParallel: the columns of every slab
+  // and then the spill of the tiles of 32 x 32 columns, one color at a time.
+  pthread_t ids[threads];
+  Slab slabs[threads];
+  Queue queues[threads];
+  const unsigned int queueSize = bench->width * bench->depth * 2;
+  for (int i = 0; i < threads; i++) {
+    const Queue queue = { malloc(queueSize * sizeof(int)), queueSize };
+    memcpy(&queues[i], &queue, sizeof(Queue));
+  }
+  for (int i = 0; i < threads; i++) {
+    const Slab slab = { bench, &queues[i], bench->depth * i / threads, bench->depth * (i + 1) / threads };
+    slabs[i] = slab;
+    pthread_create(&ids[i], 0, propagateColumnsThread, &slabs[i]);
+  }
+  for (int i = 0; i < threads; i++) {
+    pthread_join(ids[i], 0);
+  }
+  SpillBatch batches[threads];
+  for (int color = 0; color < 9; color++) {
+    for (int i = 0; i < threads; i++) {
+      const SpillBatch batch = { bench, &queues[i], color, i, threads };
+      batches[i] = batch;
+      pthread_create(&ids[i], 0, propagateSpillThread, &batches[i]);
+    }
+    for (int i = 0; i < threads; i++) {
+      pthread_join(ids[i], 0);
+    }
+  }
+  for (int i = 0; i < threads; i++) {
+    free(queues[i].data);
+  }
+}
+#endif
+
+static void runGenerate() {
+  // The interpolated generation and the light propagation on 1 and 4 threads.
+  // The threaded runs must output the exact same voxels.
+  Bench* bench = createBench(384, 128, 384);
+  const double voxels = (double) bench->width * bench->height * bench->depth;
+  double start = now();
+  generateSlab(&bench->world, bench->heightmap, bench->voxels, 1337, 0, GENERATE_INTERPOLATED, 0, bench->depth);
+  printResult("generateInterpolated", bench, now() - start, "voxels", voxels, 0);
+#if !VOXELS_PALETTE
+  // The palette layout allocates from a shared pool, so it can't run in parallel
+  const int threads = 4;
+  Bench* threaded = createBench(384, 128, 384);
+  pthread_t ids[threads];
+  Slab slabs[threads];
+  start = now();
+  for (int i = 0; i < threads; i++) {
+    const Slab slab = { threaded, 0, threaded->depth * i / threads, threaded->depth * (i + 1) / threads };
+    slabs[i] = slab;
+    pthread_create(&ids[i], 0, generateSlabThread, &slabs[i]);
+  }
+  for (int i = 0; i < threads; i++) {
+    pthread_join(ids[i], 0);
+  }
+  const double seconds = now() - start;
+  const unsigned char identical = (
+    memcmp(bench->voxels, threaded->voxels, voxels * VOXELS_STRIDE) == 0
+    && memcmp(bench->heightmap, threaded->heightmap, bench->width * bench->depth * sizeof(int)) == 0
+    && memcmp(bench->summary, threaded->summary, bench->chunks * sizeof(ChunkSummary)) == 0
+  );
+  char extra[64];
+  snprintf(extra, sizeof(extra), "\"threads\": %d, \"identical\": %s", threads, identical ? "true" : "false");
+  printResult("generateInterpolatedThreads", threaded, seconds, "voxels", voxels, extra);
+  start = now();
+  propagate(&bench->world, bench->heightmap, bench->voxels, &bench->queues[0]);
+  printResult("propagateInterpolated", bench, now() - start, "voxels", voxels, 0);
+  start = now();
+  propagateThreads(threaded, threads);
+  const double propagateSeconds = now() - start;
+  const unsigned char propagateIdentical = (
+    memcmp(bench->voxels, threaded->voxels, voxels * VOXELS_STRIDE) == 0
+  );
+  snprintf(extra, sizeof(extra), "\"threads\": %d, \"identical\": %s", threads, propagateIdentical ? "true" : "false");
+  printResult("propagateInterpolatedThreads", threaded, propagateSeconds, "voxels", voxels, extra);
+  destroyBench(threaded);
+#endif
+  destroyBench(bench);
+}
+
+static void runStream() {
+  // Slides the world one chunk along x, the same as the world streaming does
+  // when the camera moves into the next chunk: shift the voxels, generate the
+  // columns that come in and clear the light of them and the ones next to the
+  // dropped ones. Then relights those a chunk column at a time, the same as
+  // VoxelWorld.relightStreamed does over the next frames.
+  Bench* bench = createBench(384, 128, 384);
+  const int size = bench->world.chunkSize,
+            steps = 8;
+  generateRegion(&bench->world, bench->heightmap, bench->voxels, 1337, 0, GENERATE_INTERPOLATED, 0, 0, 0, bench->width, 0, bench->depth);
+  propagate(&bench->world, bench->heightmap, bench->voxels, &bench->queues[0]);
+  double stepSeconds = 0, relightSeconds = 0, slowest = 0;
+  int pieces = 0;
+  for (int i = 1; i <= steps; i++) {
+    double start = now();
+    shiftVoxels(&bench->world, bench->heightmap, bench->voxels, size, 0);
+    generateRegion(
+      &bench->world, bench->heightmap, bench->voxels, 1337, 0, GENERATE_INTERPOLATED,
+      i * size, 0, bench->width - size, bench->width, 0, bench->depth
+    );
+    clearRegion(&bench->world, bench->heightmap, bench->voxels, bench->width - size, bench->width, 0, bench->depth);
+    clearRegion(&bench->world, bench->heightmap, bench->voxels, 0, size, 0, bench->depth);
+    stepSeconds += now() - start;
+    for (int x = bench->width - size; x >= 0; x -= bench->width - size) {
+      for (int z = 0; z < bench->depth; z += size, pieces++) {
+        start = now();
+        relightRegion(&bench->world, bench->heightmap, bench->voxels, bench->dirty, &bench->queues[0], x, x + size, z, z + size);
+        const double seconds = now() - start;
+        relightSeconds += seconds;
+        if (slowest < seconds) slowest = seconds;
+      }
+    }
+  }
+  // Per step, counting the voxels that came in
+  printResult("streamChunk", bench, stepSeconds / steps, "voxels", (double) size * bench->height * bench->depth, 0);
+  // Per chunk column, with the slowest one, which bounds the frame time
+  char extra[64];
+  snprintf(extra, sizeof(extra), "\"slowest\": %.6f", slowest);
+  printResult("streamRelightColumn", bench, relightSeconds / pieces, "voxels", (double) size * bench->height * size, extra);
+  destroyBench(bench);
+}
+
+static void runTerrain(Output* output) {
+  // Full world generate + propagate, mesh all the chunks and 1000 brush edits
+  Bench* bench = createBench(384, 128, 384);
+  const double voxels = (double) bench->width * bench->height * bench->depth;
+  double start = now();
+  generate(&bench->world, bench->heightmap, bench->voxels, 1337, 0);
+  printResult("generate", bench, now() - start, "voxels", voxels, 0);
+
+  start = now();
+  propagate(&bench->world, bench->heightmap, bench->voxels, &bench->queues[0]);
+  printResult("propagate", bench, now() - start, "voxels", voxels, 0);
+
+  meshAll(bench, output, 0, 1, "mesh");
+  meshAll(bench, output, MESH_GREEDY, 1, "meshGreedy");
+  meshAll(bench, output, MESH_GREEDY | MESH_PACKED, 1, "meshGreedyPacked");
+  meshAll(bench, output, MESH_GREEDY | MESH_SHARED_INDICES, 1, "meshGreedyShared");
+  meshAll(bench, output, 0, 2, "meshLOD2");
+  meshAll(bench, output, 0, 4, "meshLOD4");
+  meshAll(bench, output, 0, 8, "meshLOD8");
+
+  // Spheres of radius 3 around the surface, cycling through
+  // removing blocks, placing blocks and placing lights.
+  const int radius = 3;
+  int* edits = malloc(sizeof(int) * 7 * (radius * 2 + 1) * (radius * 2 + 1) * (radius * 2 + 1));
+  unsigned long count = 0;
+  double editSeconds = 0, meshSeconds = 0;
+  unsigned long remeshed = 0;
+  for (int brush = 0; brush < 1000; brush++) {
+    const int cx = 32 + random32() % (bench->width - 64),
+              cz = 32 + random32() % (bench->depth - 64),
+              cy = bench->heightmap[cz * bench->width + cx] + 1,
+              type = brush % 3 == 0 ? TYPE_AIR : (brush % 3 == 1 ? TYPE_STONE : TYPE_LIGHT);
+    const unsigned int color = random32();
+    unsigned int size = 0;
+    for (int z = -radius; z <= radius; z++) {
+      for (int y = -radius; y <= radius; y++) {
+        for (int x = -radius; x <= radius; x++) {
+          if (x * x + y * y + z * z > radius * radius) {
+            continue;
+          }
+          int* edit = &edits[size++ * 7];
+          edit[0] = cx + x;
+          edit[1] = cy + y;
+          edit[2] = cz + z;
+          edit[3] = type;
+          edit[4] = (color >> 16) & 0xFF;
+          edit[5] = (color >> 8) & 0xFF;
+          edit[6] = color & 0xFF;
+        }
+      }
+    }
+    start = now();
+    updateBatch(
+      &bench->world,
+      bench->heightmap,
+      bench->voxels,
+      bench->dirty,
+      &bench->queues[0],
+      &bench->queues[1],
+      edits,
+      size
+    );
+    editSeconds += now() - start;
+    count += size;
+    // Remesh the dirty chunks like the editor does after every brush
+    start = now();
+    for (unsigned int chunk = 0; chunk < bench->chunks; chunk++) {
+      if (!((bench->dirty[chunk >> 5] >> (chunk & 31)) & 1)) {
+        continue;
+      }
+      const int chunksX = bench->width / 32,
+                chunksY = bench->height / 32;
+      mesh(
+        &bench->world,
+        bench->voxels,
+        output->bounds,
+        output->indices,
+        output->vertices,
+        output->colors,
+        32,
+        (chunk % chunksX) * 32,
+        ((chunk / chunksX) % chunksY) * 32,
+        (chunk / (chunksX * chunksY)) * 32,
+        MESH_GREEDY
+      );
+    }
+    meshSeconds += now() - start;
+    remeshed += countDirty(bench);
+  }
+  free(edits);
+  char extra[64];
+  snprintf(extra, sizeof(extra), "\"brushes\": 1000, \"brushesPerSecond\": %.0f", 1000 / editSeconds);
+  printResult("updateBatch", bench, editSeconds, "edits", count, extra);
+  printResult("remeshDirty", bench, meshSeconds, "chunks", remeshed, 0);
+  destroyBench(bench);
+}
+
+static void runSand(void) {
+  // Same setup as the animation test: 300 steps of falling sand
+  Bench* bench = createBench(96, 320, 96);
+  generate(&bench->world, bench->heightmap, bench->voxels, 1337, 1);
+  for (int z = 0; z < bench->depth; z++) {
+    exportVoxels(&bench->world, bench->voxels, z, bench->slice);
+    for (int i = 0; i < bench->width * bench->height * VOXELS_STRIDE; i += VOXELS_STRIDE) {
+      if (bench->slice[i + VOXEL_TYPE] == TYPE_STONE) {
+        bench->slice[i + VOXEL_TYPE] = TYPE_SAND;
+      }
+    }
+    importVoxels(&bench->world, bench->voxels, z, bench->slice);
+  }
+  propagate(&bench->world, bench->heightmap, bench->voxels, &bench->queues[0]);
+  // Same size as the VoxelWorld edits buffer it gets in the browser
+  const unsigned int maxMoves = 4096 * 7;
+  int* moves = malloc(maxMoves * sizeof(int));
+  const int steps = 300;
+  unsigned long dirty = 0;
+  double seconds = 0;
+  for (int step = 0; step < steps; step++) {
+    const double start = now();
+    simulate(
+      &bench->world,
+      bench->heightmap,
+      bench->voxels,
+      bench->dirty,
+      bench->awake,
+      &bench->queues[0],
+      &bench->queues[1],
+      moves,
+      maxMoves,
+      step
+    );
+    seconds += now() - start;
+    dirty += countDirty(bench);
+  }
+  free(moves);
+  char extra[64];
+  snprintf(extra, sizeof(extra), "\"steps\": %d, \"dirtyChunks\": %lu", steps, dirty);
+  printResult(
+    "simulate",
+    bench,
+    seconds,
+    "voxels",
+    (double) bench->width * bench->height * bench->depth * steps,
+    extra
+  );
+  destroyBench(bench);
+}
+
+int main(int argc, char** argv) {
+  // Optional arguments: the scenarios to run (terrain, generate, sand)
+  unsigned char terrain = argc < 2, generation = argc < 2, sand = argc < 2;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "terrain") == 0) terrain = 1;
+    else if (strcmp(argv[i], "generate") == 0) generation = 1;
+    else if (strcmp(argv[i], "sand") == 0) sand = 1;
+    else {
+      fprintf(stderr, "Unknown scenario: %s\n", argv[i]);
+      return 1;
+    }
+  }
+  const unsigned int maxFaces = MAX_CHUNK_SIZE * MAX_CHUNK_SIZE * MAX_CHUNK_SIZE / 2 * 6;
+  Output output = {
+    malloc(maxFaces * 6 * sizeof(unsigned int)),
+    malloc(maxFaces * 4 * 8),
+    malloc(maxFaces * 4),
+  };
+  const char* layouts[] = { "interleaved", "planar", "palette" };
+  printf(
+    "{\n  \"layout\": \"%s\",\n  \"simd\": %s,\n  \"results\": [\n",
+    layouts[getLayout()],
+    VOXELS_SIMD ? "true" : "false"
+  );
+  if (terrain) runTerrain(&output);
+  if (generation) {
+    runGenerate();
+    runStream();
+  }
+  if (sand) runSand();
+  printf("\n  ]\n}\n");
+  free(output.indices);
+  free(output.vertices);
+  free(output.colors);
+  return 0;
+}
@@ -0,0 +1,302 @@
+#ifndef VOXELS_PALETTE_H
+#define VOXELS_PALETTE_H
+
+// Palette compressed voxel storage.
+// The world is split into 32^3 chunks. Each chunk has a palette of
+// (type << 24 | rgb) entries and the bit-packed palette index of every voxel,
+// plus a plane with the light and sunlight levels of every voxel.
+// All-air chunks don't allocate any palette or indices and chunks where every
+// voxel has the same light levels don't allocate a light plane.
+// Everything gets allocated from a fixed-size pool that the JS side reserves
+// on the wasm memory. When it runs out, the writes get dropped and the
+// overflow counter bumped, same as the light queues.
+
+#define PALETTE_CHUNK_BITS 5
+#define PALETTE_CHUNK_SIZE (1 << PALETTE_CHUNK_BITS)
+#define PALETTE_CHUNK_VOXELS (PALETTE_CHUNK_SIZE * PALETTE_CHUNK_SIZE * PALETTE_CHUNK_SIZE)
+#define PALETTE_MAX_BITS 16
+#define PALETTE_POOL_CLASSES 16
+
+typedef struct {
+  unsigned int palette;
+  unsigned int indices;
+  unsigned int light;
+  unsigned int size;
+  unsigned int bits; // 0 means the chunk is all air
+  unsigned int blocks; // Count of non-air voxels
+  unsigned int types; // Bitmask of the block types in the palette
+  unsigned int uniformLight; // (sunlight << 8 | light) of every voxel when there's no light plane
+} PaletteChunk;
+
+typedef struct {
+  unsigned char* const pool;
+  const unsigned int poolSize;
+  unsigned int poolUsed;
+  unsigned int overflow;
+  unsigned int freeBlocks[PALETTE_POOL_CLASSES];
+  PaletteChunk chunks[];
+} Voxels;
+
+static const unsigned char getPoolClass(const unsigned int size) {
+  // Blocks are powers of two from 16 bytes up
+  unsigned char c = 0;
+  while ((16u << c) < size) c++;
+  return c;
+}
+
+static const unsigned int allocPool(
+  Voxels* voxels,
+  const unsigned int size
+) {
+  // Returns the offset of the block in the pool or 0 when it's full.
+  const unsigned char c = getPoolClass(size);
+  unsigned int block = voxels->freeBlocks[c];
+  if (block != 0) {
+    voxels->freeBlocks[c] = *(unsigned int*) (voxels->pool + block);
+    return block;
+  }
+  // Offset 0 is reserved to mean "no block"
+  if (voxels->poolUsed < 16) voxels->poolUsed = 16;
+  if (voxels->poolUsed + (16u << c) > voxels->poolSize) {
+    voxels->overflow++;
+    return 0;
+  }
+  block = voxels->poolUsed;
+  voxels->poolUsed += 16u << c;
+  return block;
+}
+
+static void freePool(
+  Voxels* voxels,
+  const unsigned int block,
+  const unsigned int size
+) {
+  const unsigned char c = getPoolClass(size);
+  *(unsigned int*) (voxels->pool + block) = voxels->freeBlocks[c];
+  voxels->freeBlocks[c] = block;
+}
+
+static const unsigned int getPaletteCapacity(const unsigned int bits) {
+  // A chunk can't reference more entries than it has voxels
+  return bits >= 15 ? PALETTE_CHUNK_VOXELS : 1u << bits;
+}
+
+static inline const unsigned int getPaletteIndex(
+  const Voxels* voxels,
+  const PaletteChunk* chunk,
+  const unsigned int local
+) {
+  // Indices never straddle two words since bits is a power of two
+  const unsigned int bit = local * chunk->bits;
+  const unsigned int* indices = (const unsigned int*) (voxels->pool + chunk->indices);
+  return (indices[bit >> 5] >> (bit & 31)) & ((1u << chunk->bits) - 1);
+}
+
+static inline void setPaletteIndex(
+  Voxels* voxels,
+  const PaletteChunk* chunk,
+  const unsigned int local,
+  const unsigned int index
+) {
+  const unsigned int bit = local * chunk->bits;
+  unsigned int* word = &((unsigned int*) (voxels->pool + chunk->indices))[bit >> 5];
+  const unsigned int mask = ((1u << chunk->bits) - 1) << (bit & 31);
+  *word = (*word & ~mask) | (index << (bit & 31));
+}
+
+static inline const unsigned int getPaletteEntry(
+  const Voxels* voxels,
+  const int voxel
+) {
+  const PaletteChunk* chunk = &voxels->chunks[voxel / PALETTE_CHUNK_VOXELS];
+  if (chunk->bits == 0) {
+    return 0;
+  }
+  const unsigned int* palette = (const unsigned int*) (voxels->pool + chunk->palette);
+  return palette[getPaletteIndex(voxels, chunk, voxel % PALETTE_CHUNK_VOXELS)];
+}
+
+static inline const unsigned char hasPaletteType(
+  const Voxels* voxels,
+  const int voxel,
+  const unsigned char type
+) {
+  // Cheap test for the whole chunk. It can give false positives
+  // since the types only get cleared when the palette is compacted.
+  return (voxels->chunks[voxel / PALETTE_CHUNK_VOXELS].types >> type) & 1;
+}
+
+static void releasePalette(
+  Voxels* voxels,
+  PaletteChunk* chunk
+) {
+  freePool(voxels, chunk->palette, getPaletteCapacity(chunk->bits) * 4);
+  freePool(voxels, chunk->indices, PALETTE_CHUNK_VOXELS / 8 * chunk->bits);
+  chunk->palette = chunk->indices = 0;
+  chunk->size = chunk->bits = chunk->blocks = chunk->types = 0;
+}
+
+static const unsigned char resizePalette(
+  Voxels* voxels,
+  PaletteChunk* chunk,
+  const unsigned int bits
+) {
+  // Moves the palette and the indices into blocks of the requested bit size.
+  // An all-air chunk gets a new palette with air as the first entry.
+  const unsigned int palette = allocPool(voxels, getPaletteCapacity(bits) * 4);
+  if (palette == 0) {
+    return 0;
+  }
+  const unsigned int indices = allocPool(voxels, PALETTE_CHUNK_VOXELS / 8 * bits);
+  if (indices == 0) {
+    freePool(voxels, palette, getPaletteCapacity(bits) * 4);
+    return 0;
+  }
+  PaletteChunk resized = *chunk;
+  resized.palette = palette;
+  resized.indices = indices;
+  resized.bits = bits;
+  if (chunk->bits == 0) {
+    *(unsigned int*) (voxels->pool + palette) = 0;
+    resized.size = 1;
+    __builtin_memset(voxels->pool + indices, 0, PALETTE_CHUNK_VOXELS / 8 * bits);
+  } else {
+    __builtin_memcpy(voxels->pool + palette, voxels->pool + chunk->palette, chunk->size * 4);
+    for (unsigned int local = 0; local < PALETTE_CHUNK_VOXELS; local++) {
+      setPaletteIndex(voxels, &resized, local, getPaletteIndex(voxels, chunk, local));
+    }
+    freePool(voxels, chunk->palette, getPaletteCapacity(chunk->bits) * 4);
+    freePool(voxels, chunk->indices, PALETTE_CHUNK_VOXELS / 8 * chunk->bits);
+  }
+  *chunk = resized;
+  return 1;
+}
+
+static void compactPalette(
+  Voxels* voxels,
+  PaletteChunk* chunk
+) {
+  // Drops the entries that no voxel references anymore.
+  // Air stays as the first entry.
+  unsigned int used[PALETTE_CHUNK_VOXELS / 32] = { 1 };
+  unsigned int offsets[PALETTE_CHUNK_VOXELS / 32];
+  for (unsigned int local = 0; local < PALETTE_CHUNK_VOXELS; local++) {
+    const unsigned int index = getPaletteIndex(voxels, chunk, local);
+    used[index >> 5] |= 1u << (index & 31);
+  }
+  unsigned int* palette = (unsigned int*) (voxels->pool + chunk->palette);
+  unsigned int size = 0;
+  chunk->types = 0;
+  for (unsigned int word = 0; word < (chunk->size + 31) / 32; word++) {
+    offsets[word] = size;
+    for (unsigned int bits = used[word]; bits != 0; bits &= bits - 1) {
+      const unsigned int entry = palette[word * 32 + __builtin_ctz(bits)];
+      chunk->types |= 1u << (entry >> 24);
+      palette[size++] = entry;
+    }
+  }
+  chunk->size = size;
+  for (unsigned int local = 0; local < PALETTE_CHUNK_VOXELS; local++) {
+    const unsigned int index = getPaletteIndex(voxels, chunk, local);
+    setPaletteIndex(
+      voxels,
+      chunk,
+      local,
+      offsets[index >> 5] + __builtin_popcount(used[index >> 5] & ((1u << (index & 31)) - 1))
+    );
+  }
+}
+
+static const unsigned char setPaletteEntry(
+  Voxels* voxels,
+  const int voxel,
+  const unsigned int entry
+) {
+  // Air must always be passed as entry 0.
+  // Returns 0 if the pool ran out of space and the write was dropped.
+  PaletteChunk* chunk = &voxels->chunks[voxel / PALETTE_CHUNK_VOXELS];
+  const unsigned int local = voxel % PALETTE_CHUNK_VOXELS;
+  if (chunk->bits == 0) {
+    if (entry == 0) {
+      return 1;
+    }
+    if (!resizePalette(voxels, chunk, 1)) {
+      return 0;
+    }
+  }
+  const unsigned int* palette = (const unsigned int*) (voxels->pool + chunk->palette);
+  const unsigned int current = palette[getPaletteIndex(voxels, chunk, local)];
+  if (current == entry) {
+    return 1;
+  }
+  unsigned int index = 0;
+  while (index < chunk->size && palette[index] != entry) index++;
+  if (index == chunk->size) {
+    if (chunk->size == getPaletteCapacity(chunk->bits)) {
+      compactPalette(voxels, chunk);
+      if (
+        chunk->size == getPaletteCapacity(chunk->bits)
+        && (
+          chunk->bits == PALETTE_MAX_BITS
+          || !resizePalette(voxels, chunk, chunk->bits * 2)
+        )
+      ) {
+        if (chunk->bits == PALETTE_MAX_BITS) voxels->overflow++;
+        return 0;
+      }
+      palette = (const unsigned int*) (voxels->pool + chunk->palette);
+    }
+    index = chunk->size++;
+    ((unsigned int*) palette)[index] = entry;
+    chunk->types |= 1u << (entry >> 24);
+  }
+  setPaletteIndex(voxels, chunk, local, index);
+  if (current == 0) {
+    chunk->blocks++;
+  } else if (entry == 0 && --chunk->blocks == 0) {
+    // Collapse back to the all-air sentinel
+    releasePalette(voxels, chunk);
+  }
+  return 1;
+}
+
+static inline const unsigned char getPaletteLight(
+  const Voxels* voxels,
+  const int voxel,
+  const unsigned char channel
+) {
+  // Channel 0 is light and 1 is sunlight
+  const PaletteChunk* chunk = &voxels->chunks[voxel / PALETTE_CHUNK_VOXELS];
+  if (chunk->light == 0) {
+    return (chunk->uniformLight >> (channel * 8)) & 0xFF;
+  }
+  return voxels->pool[chunk->light + (voxel % PALETTE_CHUNK_VOXELS) * 2 + channel];
+}
+
+static const unsigned char setPaletteLight(
+  Voxels* voxels,
+  const int voxel,
+  const unsigned char channel,
+  const unsigned char value
+) {
+  // Returns 0 if the pool ran out of space and the write was dropped.
+  PaletteChunk* chunk = &voxels->chunks[voxel / PALETTE_CHUNK_VOXELS];
+  if (chunk->light == 0) {
+    if (((chunk->uniformLight >> (channel * 8)) & 0xFF) == value) {
+      return 1;
+    }
+    const unsigned int plane = allocPool(voxels, PALETTE_CHUNK_VOXELS * 2);
+    if (plane == 0) {
+      return 0;
+    }
+    for (unsigned int local = 0; local < PALETTE_CHUNK_VOXELS; local++) {
+      voxels->pool[plane + local * 2] = chunk->uniformLight & 0xFF;
+      voxels->pool[plane + local * 2 + 1] = chunk->uniformLight >> 8;
+    }
+    chunk->light = plane;
+  }
+  voxels->pool[chunk->light + (voxel % PALETTE_CHUNK_VOXELS) * 2 + channel] = value;
+  return 1;
+}
+
+#endif
@@ -0,0 +1,118 @@
+#ifndef VOXELS_SIMD_H
+#define VOXELS_SIMD_H
+
+// Tiny 4 x float32 / 16 x uint8 vector abstraction used by the hot kernels.
+// It maps to wasm_simd128 when building with -msimd128, to SSE2 or NEON
+// on native builds and to plain scalar code everywhere else.
+// The uint8 ops are only available when VOXELS_SIMD is 1.
+// All the float ops are lane-wise IEEE, so every path produces the exact same output.
+
+#if defined(__wasm_simd128__)
+
+#include <wasm_simd128.h>
+
+#define VOXELS_SIMD 1
+
+typedef v128_t simd_f32;
+typedef v128_t simd_u8;
+
+static inline simd_f32 simdF32FromInts(const int a, const int b, const int c, const int d) {
+  return wasm_f32x4_convert_i32x4(wasm_i32x4_make(a, b, c, d));
+}
+static inline simd_f32 simdF32Splat(const float v) { return wasm_f32x4_splat(v); }
+static inline simd_f32 simdF32Add(const simd_f32 a, const simd_f32 b) { return wasm_f32x4_add(a, b); }
+static inline simd_f32 simdF32Sub(const simd_f32 a, const simd_f32 b) { return wasm_f32x4_sub(a, b); }
+static inline simd_f32 simdF32Mul(const simd_f32 a, const simd_f32 b) { return wasm_f32x4_mul(a, b); }
+static inline simd_f32 simdF32Div(const simd_f32 a, const simd_f32 b) { return wasm_f32x4_div(a, b); }
+static inline void simdF32ToInts(const simd_f32 v, int* out) {
+  wasm_v128_store(out, wasm_i32x4_trunc_sat_f32x4(v));
+}
+static inline simd_u8 simdU8Splat(const unsigned char v) { return wasm_i8x16_splat(v); }
+static inline simd_u8 simdU8Load(const unsigned char* p) { return wasm_v128_load(p); }
+static inline simd_u8 simdU8And(const simd_u8 a, const simd_u8 b) { return wasm_v128_and(a, b); }
+static inline simd_u8 simdU8Eq(const simd_u8 a, const simd_u8 b) { return wasm_i8x16_eq(a, b); }
+static inline int simdU8Any(const simd_u8 v) { return wasm_v128_any_true(v); }
+
+#elif defined(__SSE2__)
+
+#include <emmintrin.h>
+
+#define VOXELS_SIMD 1
+
+typedef __m128 simd_f32;
+typedef __m128i simd_u8;
+
+static inline simd_f32 simdF32FromInts(const int a, const int b, const int c, const int d) {
+  return _mm_cvtepi32_ps(_mm_setr_epi32(a, b, c, d));
+}
+static inline simd_f32 simdF32Splat(const float v) { return _mm_set1_ps(v); }
+static inline simd_f32 simdF32Add(const simd_f32 a, const simd_f32 b) { return _mm_add_ps(a, b); }
+static inline simd_f32 simdF32Sub(const simd_f32 a, const simd_f32 b) { return _mm_sub_ps(a, b); }
+static inline simd_f32 simdF32Mul(const simd_f32 a, const simd_f32 b) { return _mm_mul_ps(a, b); }
+static inline simd_f32 simdF32Div(const simd_f32 a, const simd_f32 b) { return _mm_div_ps(a, b); }
+static inline void simdF32ToInts(const simd_f32 v, int* out) {
+  _mm_storeu_si128((__m128i*) out, _mm_cvttps_epi32(v));
+}
+static inline simd_u8 simdU8Splat(const unsigned char v) { return _mm_set1_epi8(v); }
+static inline simd_u8 simdU8Load(const unsigned char* p) { return _mm_loadu_si128((const __m128i*) p); }
+static inline simd_u8 simdU8And(const simd_u8 a, const simd_u8 b) { return _mm_and_si128(a, b); }
+static inline simd_u8 simdU8Eq(const simd_u8 a, const simd_u8 b) { return _mm_cmpeq_epi8(a, b); }
+static inline int simdU8Any(const simd_u8 v) { return _mm_movemask_epi8(v) != 0; }
+
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+
+#include <arm_neon.h>
+
+#define VOXELS_SIMD 1
+
+typedef float32x4_t simd_f32;
+typedef uint8x16_t simd_u8;
+
+static inline simd_f32 simdF32FromInts(const int a, const int b, const int c, const int d) {
+  const int32_t v[4] = { a, b, c, d };
+  return vcvtq_f32_s32(vld1q_s32(v));
+}
+static inline simd_f32 simdF32Splat(const float v) { return vdupq_n_f32(v); }
+static inline simd_f32 simdF32Add(const simd_f32 a, const simd_f32 b) { return vaddq_f32(a, b); }
+static inline simd_f32 simdF32Sub(const simd_f32 a, const simd_f32 b) { return vsubq_f32(a, b); }
+static inline simd_f32 simdF32Mul(const simd_f32 a, const simd_f32 b) { return vmulq_f32(a, b); }
+static inline simd_f32 simdF32Div(const simd_f32 a, const simd_f32 b) { return vdivq_f32(a, b); }
+static inline void simdF32ToInts(const simd_f32 v, int* out) { vst1q_s32(out, vcvtq_s32_f32(v)); }
+static inline simd_u8 simdU8Splat(const unsigned char v) { return vdupq_n_u8(v); }
+static inline simd_u8 simdU8Load(const unsigned char* p) { return vld1q_u8(p); }
+static inline simd_u8 simdU8And(const simd_u8 a, const simd_u8 b) { return vandq_u8(a, b); }
+static inline simd_u8 simdU8Eq(const simd_u8 a, const simd_u8 b) { return vceqq_u8(a, b); }
+static inline int simdU8Any(const simd_u8 v) { return vmaxvq_u8(v) != 0; }
+
+#else
+
+#define VOXELS_SIMD 0
+
+typedef struct { float v[4]; } simd_f32;
+
+static inline simd_f32 simdF32FromInts(const int a, const int b, const int c, const int d) {
+  const simd_f32 r = { { a, b, c, d } };
+  return r;
+}
+static inline simd_f32 simdF32Splat(const float v) {
+  const simd_f32 r = { { v, v, v, v } };
+  return r;
+}
+#define SIMD_F32_OP(name, op) \
+  static inline simd_f32 name(const simd_f32 a, const simd_f32 b) { \
+    simd_f32 r; \
+    for (int i = 0; i < 4; i++) r.v[i] = a.v[i] op b.v[i]; \
+    return r; \
+  }
+SIMD_F32_OP(simdF32Add, +)
+SIMD_F32_OP(simdF32Sub, -)
+SIMD_F32_OP(simdF32Mul, *)
+SIMD_F32_OP(simdF32Div, /)
+#undef SIMD_F32_OP
+static inline void simdF32ToInts(const simd_f32 v, int* out) {
+  for (int i = 0; i < 4; i++) out[i] = (int) v.v[i];
+}
+
+#endif
+
+#endif
@@ -1,5 +1,6 @@
 #define FNL_IMPL
 #include "../vendor/FastNoiseLite.h"
+#include "simd.h"
 
 enum BlockTypes {
   TYPE_AIR,
@@ -8,6 +9,11 @@ enum BlockTypes {
   TYPE_SAND
 };
 
+enum BrushShapes {
+  BRUSH_BOX,
+  BRUSH_SPHERE
+};
+
 enum VoxelFields {
   VOXEL_TYPE,
   VOXEL_R,
@@ -18,13 +24,85 @@ enum VoxelFields {
   VOXELS_STRIDE
 };
 
+// Voxel storage layout.
+// By default the fields of each voxel are interleaved (VOXELS_STRIDE bytes per voxel).
+// Building with -DVOXELS_PLANAR=1 stores each field on its own plane instead, so
+// the loops that only test the type (meshing, light flooding, simulation) read
+// a contiguous byte per voxel. Either way the buffer is the same size and
+// getVoxel returns the offset of the type, the other fields are at getField().
+// Building with -DVOXELS_PALETTE=1 uses the palette compressed chunks in
+// palette.h instead, and getVoxel returns a (chunk, voxel) handle.
+// All the code accesses the voxels through getType/getColor/getLight and
+// setBlock/setType/setLight, so it works the same with any layout.
+#ifndef VOXELS_PLANAR
+#define VOXELS_PLANAR 0
+#endif
+#ifndef VOXELS_PALETTE
+#define VOXELS_PALETTE 0
+#endif
+
+#if VOXELS_PALETTE
+#include "palette.h"
+#else
+typedef unsigned char Voxels;
+#endif
+
+#if VOXELS_PLANAR
+#define VOXELS_STEP 1
+#else
+#define VOXELS_STEP VOXELS_STRIDE
+#endif
+
+enum MeshFlags {
+  MESH_GREEDY = 1,
+  MESH_PACKED = 2,
+  MESH_SHARED_INDICES = 4
+};
+
+#define MAX_CHUNK_SIZE 32
+
+enum ChunkOccupancy {
+  CHUNK_MIXED = 0,
+  CHUNK_EMPTY = 1,
+  CHUNK_SOLID = 2,
+  CHUNK_ENCLOSED = 3
+};
+
+typedef struct {
+  unsigned int blocks; // Count of non-air voxels
+  unsigned int faces[6]; // Count of non-air voxels on the layer facing each of the neighbors[]
+  unsigned int visibility; // Pairs of faces connected through the air of the chunk (see getFacePair)
+} ChunkSummary;
+
+// Every pair of faces is connected
+#define VISIBILITY_ALL 0x7FFF
+
 typedef struct {
   const int width;
   const int height;
   const int depth;
+  const int chunkSize;
+  // One entry per chunk (x, then y, then z) that setBlock and setType keep up to date.
+  // It can be null, in which case nothing gets counted and nothing gets skipped.
+  ChunkSummary* const summary;
+  // Where the column at (0, 0) is stored on the dense layouts. The storage wraps
+  // around at the edges, so shiftVoxels can slide the world by moving these
+  // instead of the voxels. They're always a multiple of the chunkSize.
+  int offsetX;
+  int offsetZ;
 } World;
 
+typedef struct {
+  int* const data;
+  const unsigned int capacity;
+  unsigned int head;
+  unsigned int size;
+  unsigned int peak;
+  unsigned int overflow;
+} Queue;
+
 static const unsigned char maxLight = 32;
+static const unsigned char aoStep = 20;
 
 static const int neighbors[] = {
   1, 0, 0,
@@ -35,6 +113,23 @@ static const int neighbors[] = {
   0, -1, 0
 };
 
+typedef struct {
+  const unsigned char axis;
+  const signed char direction;
+  const unsigned char u;
+  const unsigned char v;
+  const unsigned char corners[8];
+} Side;
+
+static const Side sides[] = {
+  { 1, 1, 0, 2, { 0, 1, 1, 1, 1, 0, 0, 0 } }, // top
+  { 1, -1, 0, 2, { 0, 0, 1, 0, 1, 1, 0, 1 } }, // bottom
+  { 2, 1, 0, 1, { 0, 0, 1, 0, 1, 1, 0, 1 } }, // south
+  { 2, -1, 0, 1, { 1, 0, 0, 0, 0, 1, 1, 1 } }, // north
+  { 0, 1, 2, 1, { 1, 0, 0, 0, 0, 1, 1, 1 } }, // east
+  { 0, -1, 2, 1, { 0, 0, 1, 0, 1, 1, 0, 1 } } // west
+};
+
 static const int getVoxel(
   const World* world,
   const int x,
@@ -48,7 +143,264 @@ static const int getVoxel(
   ) {
     return -1;
   }
-  return (z * world->width * world->height + y * world->width + x) * VOXELS_STRIDE;
+#if VOXELS_PALETTE
+  const int chunk = (
+    ((z >> PALETTE_CHUNK_BITS) * (world->height >> PALETTE_CHUNK_BITS) + (y >> PALETTE_CHUNK_BITS))
+    * (world->width >> PALETTE_CHUNK_BITS)
+    + (x >> PALETTE_CHUNK_BITS)
+  );
+  const int mask = PALETTE_CHUNK_SIZE - 1;
+  return chunk * PALETTE_CHUNK_VOXELS + (
+    ((((z & mask) << PALETTE_CHUNK_BITS) | (y & mask)) << PALETTE_CHUNK_BITS) | (x & mask)
+  );
+#else
+  int px = x + world->offsetX,
+      pz = z + world->offsetZ;
+  if (px >= world->width) px -= world->width;
+  if (pz >= world->depth) pz -= world->depth;
+  return (pz * world->width * world->height + y * world->width + px) * VOXELS_STEP;
+#endif
+}
+
+static void getPosition(
+  const World* world,
+  const int voxel,
+  int* position
+) {
+  // Inverse of getVoxel
+#if VOXELS_PALETTE
+  const int chunk = voxel / PALETTE_CHUNK_VOXELS,
+            local = voxel % PALETTE_CHUNK_VOXELS,
+            mask = PALETTE_CHUNK_SIZE - 1,
+            chunksX = world->width >> PALETTE_CHUNK_BITS,
+            chunksY = world->height >> PALETTE_CHUNK_BITS;
+  position[0] = ((chunk % chunksX) << PALETTE_CHUNK_BITS) | (local & mask);
+  position[1] = (((chunk / chunksX) % chunksY) << PALETTE_CHUNK_BITS) | ((local >> PALETTE_CHUNK_BITS) & mask);
+  position[2] = ((chunk / (chunksX * chunksY)) << PALETTE_CHUNK_BITS) | (local >> (PALETTE_CHUNK_BITS * 2));
+#else
+  const int index = voxel / VOXELS_STEP;
+  position[2] = _fnlFastFloor(index / (world->width * world->height)) - world->offsetZ;
+  position[1] = _fnlFastFloor((index % (world->width * world->height)) / world->width);
+  position[0] = _fnlFastFloor((index % (world->width * world->height)) % world->width) - world->offsetX;
+  if (position[0] < 0) position[0] += world->width;
+  if (position[2] < 0) position[2] += world->depth;
+#endif
+}
+
+static inline const int getNextVoxel(
+  const World* world,
+  const int voxel,
+  const int x
+) {
+  // Returns the voxel at x + 1 from the one at x. The caller must check it's inside the world.
+#if VOXELS_PALETTE
+  const int mask = PALETTE_CHUNK_SIZE - 1;
+  return (voxel & mask) == mask ? voxel + PALETTE_CHUNK_VOXELS - mask : voxel + 1;
+#else
+  return (
+    x + 1 == world->width - world->offsetX ? voxel - (world->width - 1) * VOXELS_STEP : voxel + VOXELS_STEP
+  );
+#endif
+}
+
+#if !VOXELS_PALETTE
+static inline const int getField(
+  const World* world,
+  const unsigned char field
+) {
+#if VOXELS_PLANAR
+  return field * world->width * world->height * world->depth;
+#else
+  return field;
+#endif
+}
+#endif
+
+static inline const unsigned char getType(
+  const World* world,
+  const Voxels* voxels,
+  const int voxel
+) {
+#if VOXELS_PALETTE
+  return getPaletteEntry(voxels, voxel) >> 24;
+#else
+  return voxels[voxel];
+#endif
+}
+
+static inline const unsigned int getColor(
+  const World* world,
+  const Voxels* voxels,
+  const int voxel
+) {
+#if VOXELS_PALETTE
+  return getPaletteEntry(voxels, voxel) & 0xFFFFFF;
+#else
+  return (
+    (voxels[voxel + getField(world, VOXEL_R)] << 16)
+    | (voxels[voxel + getField(world, VOXEL_G)] << 8)
+    | voxels[voxel + getField(world, VOXEL_B)]
+  );
+#endif
+}
+
+static inline const unsigned char getLight(
+  const World* world,
+  const Voxels* voxels,
+  const int voxel,
+  const unsigned char channel
+) {
+#if VOXELS_PALETTE
+  return getPaletteLight(voxels, voxel, channel - VOXEL_LIGHT);
+#else
+  return voxels[voxel + getField(world, channel)];
+#endif
+}
+
+static void countBlock(
+  const World* world,
+  const int voxel,
+  const int delta
+) {
+  // Adds delta to the counts of the chunk that contains the voxel
+  int position[3];
+  getPosition(world, voxel, position);
+  const int size = world->chunkSize,
+            cx = position[0] / size,
+            cy = position[1] / size,
+            cz = position[2] / size,
+            lx = position[0] - cx * size,
+            ly = position[1] - cy * size,
+            lz = position[2] - cz * size;
+  ChunkSummary* chunk = &world->summary[
+    (cz * (world->height / size) + cy) * (world->width / size) + cx
+  ];
+  chunk->blocks += delta;
+  if (lx == size - 1) chunk->faces[0] += delta;
+  if (lx == 0) chunk->faces[1] += delta;
+  if (lz == size - 1) chunk->faces[2] += delta;
+  if (lz == 0) chunk->faces[3] += delta;
+  if (ly == size - 1) chunk->faces[4] += delta;
+  if (ly == 0) chunk->faces[5] += delta;
+}
+
+static inline const unsigned char setBlock(
+  const World* world,
+  Voxels* voxels,
+  const int voxel,
+  const unsigned char type,
+  const unsigned int color
+) {
+  // Returns 0 if the write was dropped (palette pool overflow)
+  const unsigned char flips = (
+    world->summary != 0
+    && (getType(world, voxels, voxel) == TYPE_AIR) != (type == TYPE_AIR)
+  );
+#if VOXELS_PALETTE
+  // Air doesn't keep a color, so all the air shares the same palette entry
+  if (!setPaletteEntry(voxels, voxel, type == TYPE_AIR ? 0 : ((type << 24) | (color & 0xFFFFFF)))) {
+    return 0;
+  }
+#else
+  voxels[voxel] = type;
+  voxels[voxel + getField(world, VOXEL_R)] = (color >> 16) & 0xFF;
+  voxels[voxel + getField(world, VOXEL_G)] = (color >> 8) & 0xFF;
+  voxels[voxel + getField(world, VOXEL_B)] = color & 0xFF;
+#endif
+  if (flips) {
+    countBlock(world, voxel, type == TYPE_AIR ? -1 : 1);
+  }
+  return 1;
+}
+
+static inline void setType(
+  const World* world,
+  Voxels* voxels,
+  const int voxel,
+  const unsigned char type
+) {
+#if VOXELS_PALETTE
+  setBlock(world, voxels, voxel, type, getColor(world, voxels, voxel));
+#else
+  if (world->summary != 0 && (voxels[voxel] == TYPE_AIR) != (type == TYPE_AIR)) {
+    countBlock(world, voxel, type == TYPE_AIR ? -1 : 1);
+  }
+  voxels[voxel] = type;
+#endif
+}
+
+static ChunkSummary* getSummary(
+  const World* world,
+  const int chunkX,
+  const int chunkY,
+  const int chunkZ
+) {
+  // Takes chunk coordinates. Returns 0 when they're out of the world.
+  const int size = world->chunkSize,
+            chunksX = world->width / size,
+            chunksY = world->height / size,
+            chunksZ = world->depth / size;
+  if (
+    chunkX < 0 || chunkX >= chunksX
+    || chunkY < 0 || chunkY >= chunksY
+    || chunkZ < 0 || chunkZ >= chunksZ
+  ) {
+    return 0;
+  }
+  return &world->summary[(chunkZ * chunksY + chunkY) * chunksX + chunkX];
+}
+
+const unsigned char getOccupancy(
+  const World* world,
+  const int chunkX,
+  const int chunkY,
+  const int chunkZ
+) {
+  // Classifies a chunk from the summary (in chunk coordinates):
+  // CHUNK_EMPTY when it's all air, CHUNK_SOLID when it has no air,
+  // CHUNK_ENCLOSED when it's also buried under solid voxels (or the world edges)
+  // on all six sides, so it has no exposed faces, and CHUNK_MIXED otherwise.
+  const ChunkSummary* chunk = getSummary(world, chunkX, chunkY, chunkZ);
+  if (chunk == 0) {
+    return CHUNK_MIXED;
+  }
+  const unsigned int size = world->chunkSize,
+                     layer = size * size;
+  if (chunk->blocks == 0) {
+    return CHUNK_EMPTY;
+  }
+  if (chunk->blocks != layer * size) {
+    return CHUNK_MIXED;
+  }
+  for (unsigned char n = 0; n < 6; n++) {
+    const ChunkSummary* neighbor = getSummary(
+      world,
+      chunkX + neighbors[n * 3],
+      chunkY + neighbors[n * 3 + 1],
+      chunkZ + neighbors[n * 3 + 2]
+    );
+    // The opposite layer of the neighbor is the one that touches this chunk
+    if (neighbor != 0 && neighbor->faces[n ^ 1] != layer) {
+      return CHUNK_SOLID;
+    }
+  }
+  return CHUNK_ENCLOSED;
+}
+
+static inline const unsigned char setLight(
+  const World* world,
+  Voxels* voxels,
+  const int voxel,
+  const unsigned char channel,
+  const unsigned char value
+) {
+  // Returns 0 if the write was dropped (palette pool overflow)
+#if VOXELS_PALETTE
+  return setPaletteLight(voxels, voxel, channel - VOXEL_LIGHT, value);
+#else
+  voxels[voxel + getField(world, channel)] = value;
+  return 1;
+#endif
 }
 
 static const unsigned int getColorFromNoise(unsigned char noise) {
@@ -76,74 +428,147 @@ static const unsigned int getColorFromNoise(unsigned char noise) {
   );
 }
 
-static const unsigned int getLight(
-  const unsigned char* voxels,
+static void getCornerLight(
+  const World* world,
+  const Voxels* voxels,
   const unsigned char light,
   const unsigned char sunlight,
   const int n1,
   const int n2,
-  const int n3
+  const int n3,
+  int* corner
 ) {
+  // Outputs the corner AO and the sums and count of
+  // the light levels that will get averaged in getSideLight.
   unsigned char ao = 0;
   {
-    const unsigned char v1 = n1 != -1 && voxels[n1] != TYPE_AIR,
-                        v2 = n2 != -1 && voxels[n2] != TYPE_AIR,
-                        v3 = n3 != -1 && voxels[n3] != TYPE_AIR;
-    if (v1) ao += 20;
-    if (v2) ao += 20;
-    if ((v1 && v2) || v3) ao += 20;
+    const unsigned char v1 = n1 != -1 && getType(world, voxels, n1) != TYPE_AIR,
+                        v2 = n2 != -1 && getType(world, voxels, n2) != TYPE_AIR,
+                        v3 = n3 != -1 && getType(world, voxels, n3) != TYPE_AIR;
+    if (v1) ao += aoStep;
+    if (v2) ao += aoStep;
+    if ((v1 && v2) || v3) ao += aoStep;
   }
-
-  float avgLight = light;
-  float avgSunlight = sunlight;
+  int avgLight = light;
+  int avgSunlight = sunlight;
   {
-    const unsigned char v1 = n1 != -1 && voxels[n1] == TYPE_AIR,
-                        v2 = n2 != -1 && voxels[n2] == TYPE_AIR,
-                        v3 = n3 != -1 && voxels[n3] == TYPE_AIR;
+    const unsigned char v1 = n1 != -1 && getType(world, voxels, n1) == TYPE_AIR,
+                        v2 = n2 != -1 && getType(world, voxels, n2) == TYPE_AIR,
+                        v3 = n3 != -1 && getType(world, voxels, n3) == TYPE_AIR;
     unsigned char n = 1;
     if (v1) {
-      avgLight += voxels[n1 + VOXEL_LIGHT];
-      avgSunlight += voxels[n1 + VOXEL_SUNLIGHT];
+      avgLight += getLight(world, voxels, n1, VOXEL_LIGHT);
+      avgSunlight += getLight(world, voxels, n1, VOXEL_SUNLIGHT);
       n++;
     }
     if (v2) {
-      avgLight += voxels[n2 + VOXEL_LIGHT];
-      avgSunlight += voxels[n2 + VOXEL_SUNLIGHT];
+      avgLight += getLight(world, voxels, n2, VOXEL_LIGHT);
+      avgSunlight += getLight(world, voxels, n2, VOXEL_SUNLIGHT);
       n++;
     }
     if ((v1 || v2) && v3) {
-      avgLight += voxels[n3 + VOXEL_LIGHT];
-      avgSunlight += voxels[n3 + VOXEL_SUNLIGHT];
+      avgLight += getLight(world, voxels, n3, VOXEL_LIGHT);
+      avgSunlight += getLight(world, voxels, n3, VOXEL_SUNLIGHT);
       n++;
     }
-    avgLight = avgLight / n / maxLight * 0xFF;
-    avgSunlight = avgSunlight / n / maxLight * 0xFF;
+    corner[1] = avgLight;
+    corner[2] = avgSunlight;
+    corner[3] = n;
   }
-  return (
-    (ao << 16) | (((unsigned char) avgLight) << 8) | ((unsigned char) avgSunlight)
-  );
+  corner[0] = ao;
+}
+
+static void markDirty(
+  const World* world,
+  unsigned int* dirty,
+  const int x,
+  const int y,
+  const int z
+) {
+  // Flags every chunk whose mesh samples this voxel.
+  // That is, the chunks that contain it plus a 1 voxel apron.
+  if (dirty == 0) {
+    return;
+  }
+  const int size = world->chunkSize,
+            chunksX = world->width / size,
+            chunksY = world->height / size,
+            chunksZ = world->depth / size,
+            fromX = x > 0 ? (x - 1) / size : 0,
+            fromY = y > 0 ? (y - 1) / size : 0,
+            fromZ = z > 0 ? (z - 1) / size : 0,
+            toX = (x + 1) / size < chunksX ? (x + 1) / size : chunksX - 1,
+            toY = (y + 1) / size < chunksY ? (y + 1) / size : chunksY - 1,
+            toZ = (z + 1) / size < chunksZ ? (z + 1) / size : chunksZ - 1;
+  for (int cz = fromZ; cz <= toZ; cz++) {
+    for (int cy = fromY; cy <= toY; cy++) {
+      for (int cx = fromX; cx <= toX; cx++) {
+        const int chunk = cz * chunksX * chunksY + cy * chunksX + cx;
+        dirty[chunk >> 5] |= 1 << (chunk & 31);
+      }
+    }
+  }
+}
+
+static void pushQueue(
+  Queue* queue,
+  const int value
+) {
+  // When the queue is full the value gets dropped and the overflow
+  // counter bumped, so the caller can tell the memory is undersized.
+  if (queue->size >= queue->capacity) {
+    queue->overflow++;
+    return;
+  }
+  unsigned int tail = queue->head + queue->size;
+  if (tail >= queue->capacity) tail -= queue->capacity;
+  queue->data[tail] = value;
+  queue->size++;
+  if (queue->peak < queue->size) queue->peak = queue->size;
+}
+
+static const unsigned char reserveQueue(
+  Queue* queue,
+  const unsigned int count
+) {
+  // Checks there's room for count more values before the caller
+  // touches the voxels, so a (voxel, light) pair never gets split.
+  if (queue->size + count > queue->capacity) {
+    queue->overflow++;
+    return 0;
+  }
+  return 1;
+}
+
+static const int popQueue(
+  Queue* queue
+) {
+  const int value = queue->data[queue->head];
+  queue->head++;
+  if (queue->head >= queue->capacity) queue->head = 0;
+  queue->size--;
+  return value;
 }
 
 static void floodLight(
   const unsigned char channel,
   const World* world,
   const int* heightmap,
-  unsigned char* voxels,
-  int* queue,
-  const unsigned int size,
-  int* next
+  Voxels* voxels,
+  unsigned int* dirty,
+  Queue* queue
 ) {
-  unsigned int nextLength = 0;
-  for (unsigned int i = 0; i < size; i++) {
-    const int voxel = queue[i];
-    const unsigned char light = voxels[voxel + channel];
+  while (queue->size > 0) {
+    const int voxel = popQueue(queue);
+    const unsigned char light = getLight(world, voxels, voxel, channel);
     if (light == 0) {
       continue;
     }
-    const int index = voxel / VOXELS_STRIDE,
-              z = _fnlFastFloor(index / (world->width * world->height)),
-              y = _fnlFastFloor((index % (world->width * world->height)) / world->width),
-              x = _fnlFastFloor((index % (world->width * world->height)) % world->width);
+    int position[3];
+    getPosition(world, voxel, position);
+    const int x = position[0],
+              y = position[1],
+              z = position[2];
     for (unsigned char n = 0; n < 6; n += 1) {
       const int nx = x + neighbors[n * 3],
                 ny = y + neighbors[n * 3 + 1],
@@ -156,64 +581,54 @@ static void floodLight(
       );
       if (
         neighbor == -1
-        || voxels[neighbor] != TYPE_AIR
+        || getType(world, voxels, neighbor) != TYPE_AIR
         || (
           channel == VOXEL_SUNLIGHT
           && n != 5
           && light == maxLight
           && ny > heightmap[(nz * world->width) + nx]
         )
-        || voxels[neighbor + channel] >= nl
+        || getLight(world, voxels, neighbor, channel) >= nl
       ) {
         continue;
       }
-      voxels[neighbor + channel] = nl;
-      next[nextLength++] = neighbor;
+      if (!setLight(world, voxels, neighbor, channel, nl)) {
+        continue;
+      }
+      markDirty(world, dirty, nx, ny, nz);
+      pushQueue(queue, neighbor);
     }
   }
-  if (nextLength > 0) {
-    floodLight(
-      channel,
-      world,
-      heightmap,
-      voxels,
-      next,
-      nextLength,
-      queue
-    );
-  }
 }
 
 static void removeLight(
   const unsigned char channel,
   const World* world,
-  const int* heightmap,
-  unsigned char* voxels,
-  int* queue,
-  const unsigned int size,
-  int* next,
-  int* floodQueue,
-  unsigned int floodQueueSize
-) {
-  unsigned int nextLength = 0;
-  for (int i = 0; i < size; i += 2) {
-    const int voxel = queue[i];
-    const unsigned char light = queue[i + 1];
-    const int index = voxel / VOXELS_STRIDE,
-              z = _fnlFastFloor(index / (world->width * world->height)),
-              y = _fnlFastFloor((index % (world->width * world->height)) / world->width),
-              x = _fnlFastFloor((index % (world->width * world->height)) % world->width);
+  Voxels* voxels,
+  unsigned int* dirty,
+  Queue* queue,
+  Queue* floodQueue
+) {
+  // The removal queue holds (voxel, light) pairs.
+  // The voxels that need to be reflooded get pushed into floodQueue
+  // so the caller can add any other seeds before running floodLight.
+  while (queue->size >= 2) {
+    const int voxel = popQueue(queue);
+    const unsigned char light = popQueue(queue);
+    int position[3];
+    getPosition(world, voxel, position);
+    const int x = position[0],
+              y = position[1],
+              z = position[2];
     for (unsigned char n = 0; n < 6; n += 1) {
-      const int neighbor = getVoxel(
-        world,
-        x + neighbors[n * 3],
-        y + neighbors[n * 3 + 1],
-        z + neighbors[n * 3 + 2]
-      );
-      if (neighbor == -1 || voxels[neighbor] != TYPE_AIR) {
+      const int nx = x + neighbors[n * 3],
+                ny = y + neighbors[n * 3 + 1],
+                nz = z + neighbors[n * 3 + 2],
+                neighbor = getVoxel(world, nx, ny, nz);
+      if (neighbor == -1 || getType(world, voxels, neighbor) != TYPE_AIR) {
         continue;
       }
-      const unsigned char nl = voxels[neighbor + channel];
+      const unsigned char nl = getLight(world, voxels, neighbor, channel);
       if (nl == 0) {
         continue;
       }
@@ -226,37 +641,17 @@ static void removeLight(
           && nl == maxLight
         )
       ) {
-        next[nextLength++] = neighbor;
-        next[nextLength++] = nl;
-        voxels[neighbor + channel] = 0;
+        if (!reserveQueue(queue, 2) || !setLight(world, voxels, neighbor, channel, 0)) {
+          continue;
+        }
+        pushQueue(queue, neighbor);
+        pushQueue(queue, nl);
+        markDirty(world, dirty, nx, ny, nz);
       } else if (nl >= light) {
-        floodQueue[floodQueueSize++] = neighbor;
+        pushQueue(floodQueue, neighbor);
       }
     }
   }
-  if (nextLength > 0) {
-    removeLight(
-      channel,
-      world,
-      heightmap,
-      voxels,
-      next,
-      nextLength,
-      queue,
-      floodQueue,
-      floodQueueSize
-    );
-  } else if (floodQueueSize > 0) {
-    floodLight(
-      channel,
-      world,
-      heightmap,
-      voxels,
-      floodQueue,
-      floodQueueSize,
-      queue
-    );
-  }
 }
 
 static void growBox(
@@ -273,11 +668,38 @@ static void growBox(
   if (box[5] < z) box[5] = z;
 }
 
+static inline const unsigned char packLight(
+  const unsigned char light
+) {
+  // From the 0-255 range of the light averages to 6 bits
+  return (light * 63 + 127) / 255;
+}
+
+static void packVertex(
+  unsigned char* vertex,
+  const unsigned char x,
+  const unsigned char y,
+  const unsigned char z,
+  const unsigned int light
+) {
+  // The position takes the low 6 bits of the first 3 bytes and the light
+  // is split in their top 2 bits. The 4th byte holds the sunlight in the
+  // low 6 bits and the AO level (0-3) in the top 2.
+  const unsigned char l = packLight((light >> 8) & 0xFF),
+                      s = packLight(light & 0xFF),
+                      ao = ((light >> 16) & 0xFF) / aoStep;
+  vertex[0] = x | ((l & 3) << 6);
+  vertex[1] = y | (((l >> 2) & 3) << 6);
+  vertex[2] = z | (((l >> 4) & 3) << 6);
+  vertex[3] = s | (ao << 6);
+}
+
 static void pushFace(
   unsigned char* box,
   unsigned int* faces,
   unsigned int* indices,
   unsigned char* vertices,
+  unsigned char* colors,
   const int chunkX, const int chunkY, const int chunkZ,
   const unsigned char r, const unsigned char g, const unsigned char b,
   const int wx1, const int wy1, const int wz1, const unsigned int l1,
@@ -289,6 +711,21 @@ static void pushFace(
                       ao2 = ((l2 >> 16) & 0xFF) / 255.0f,
                       ao3 = ((l3 >> 16) & 0xFF) / 255.0f,
                       ao4 = ((l4 >> 16) & 0xFF) / 255.0f;
+  if (indices == 0 && ao1 + ao3 > ao2 + ao4) {
+    // Shared indices: Every quad is indexed as 0,1,2,2,3,0 so, instead of
+    // flipping the indices, the vertices get rotated by one. The rotated quad
+    // doesn't need flipping, so this only recurses once.
+    pushFace(
+      box, faces, indices, vertices, colors,
+      chunkX, chunkY, chunkZ,
+      r, g, b,
+      wx2, wy2, wz2, l2,
+      wx3, wy3, wz3, l3,
+      wx4, wy4, wz4, l4,
+      wx1, wy1, wz1, l1
+    );
+    return;
+  }
   const unsigned int  vertex = *faces * 4,
                       vertexOffset = vertex * 8,
                       indexOffset = *faces * 6,
@@ -306,524 +743,2468 @@ static void pushFace(
                       y4 = wy4 - chunkY,
                       z4 = wz4 - chunkZ;
   (*faces)++;
-  // Is this crazy? I dunno. You tell me.
-  vertices[vertexOffset] = x1;
-  vertices[vertexOffset + 1] = y1;
-  vertices[vertexOffset + 2] = z1;
-  vertices[vertexOffset + 3] = r * (1.0f - ao1);
-  vertices[vertexOffset + 4] = g * (1.0f - ao1);
-  vertices[vertexOffset + 5] = b * (1.0f - ao1);
-  vertices[vertexOffset + 6] = (l1 >> 8) & 0xFF;
-  vertices[vertexOffset + 7] = l1 & 0xFF;
-  vertices[vertexOffset + 8] = x2;
-  vertices[vertexOffset + 9] = y2;
-  vertices[vertexOffset + 10] = z2;
-  vertices[vertexOffset + 11] = r * (1.0f - ao2);
-  vertices[vertexOffset + 12] = g * (1.0f - ao2);
-  vertices[vertexOffset + 13] = b * (1.0f - ao2);
-  vertices[vertexOffset + 14] = (l2 >> 8) & 0xFF;
-  vertices[vertexOffset + 15] = l2 & 0xFF;
-  vertices[vertexOffset + 16] = x3;
-  vertices[vertexOffset + 17] = y3;
-  vertices[vertexOffset + 18] = z3;
-  vertices[vertexOffset + 19] = r * (1.0f - ao3);
-  vertices[vertexOffset + 20] = g * (1.0f - ao3);
-  vertices[vertexOffset + 21] = b * (1.0f - ao3);
-  vertices[vertexOffset + 22] = (l3 >> 8) & 0xFF;
-  vertices[vertexOffset + 23] = l3 & 0xFF;
-  vertices[vertexOffset + 24] = x4;
-  vertices[vertexOffset + 25] = y4;
-  vertices[vertexOffset + 26] = z4;
-  vertices[vertexOffset + 27] = r * (1.0f - ao4);
-  vertices[vertexOffset + 28] = g * (1.0f - ao4);
-  vertices[vertexOffset + 29] = b * (1.0f - ao4);
-  vertices[vertexOffset + 30] = (l4 >> 8) & 0xFF;
-  vertices[vertexOffset + 31] = l4 & 0xFF;
-  indices[indexOffset] = vertex + flipFace;
-  indices[indexOffset + 1] = vertex + flipFace + 1;
-  indices[indexOffset + 2] = vertex + flipFace + 2;
-  indices[indexOffset + 3] = vertex + flipFace + 2;
-  indices[indexOffset + 4] = vertex + ((flipFace + 3) % 4);
-  indices[indexOffset + 5] = vertex + flipFace;
+  if (colors != 0) {
+    // Packed format: 4 bytes per vertex and the color once per face
+    packVertex(&vertices[vertex * 4], x1, y1, z1, l1);
+    packVertex(&vertices[vertex * 4 + 4], x2, y2, z2, l2);
+    packVertex(&vertices[vertex * 4 + 8], x3, y3, z3, l3);
+    packVertex(&vertices[vertex * 4 + 12], x4, y4, z4, l4);
+    colors[vertex] = r;
+    colors[vertex + 1] = g;
+    colors[vertex + 2] = b;
+    colors[vertex + 3] = 0xFF;
+  } else {
+    // Scale the color by the AO of the 4 vertices at once
+    const simd_f32 ao = simdF32Sub(
+      simdF32Splat(1.0f),
+      simdF32Div(
+        simdF32FromInts((l1 >> 16) & 0xFF, (l2 >> 16) & 0xFF, (l3 >> 16) & 0xFF, (l4 >> 16) & 0xFF),
+        simdF32Splat(255.0f)
+      )
+    );
+    int cr[4], cg[4], cb[4];
+    simdF32ToInts(simdF32Mul(simdF32Splat(r), ao), cr);
+    simdF32ToInts(simdF32Mul(simdF32Splat(g), ao), cg);
+    simdF32ToInts(simdF32Mul(simdF32Splat(b), ao), cb);
+    // Is this crazy? I dunno. You tell me.
+    vertices[vertexOffset] = x1;
+    vertices[vertexOffset + 1] = y1;
+    vertices[vertexOffset + 2] = z1;
+    vertices[vertexOffset + 3] = cr[0];
+    vertices[vertexOffset + 4] = cg[0];
+    vertices[vertexOffset + 5] = cb[0];
+    vertices[vertexOffset + 6] = (l1 >> 8) & 0xFF;
+    vertices[vertexOffset + 7] = l1 & 0xFF;
+    vertices[vertexOffset + 8] = x2;
+    vertices[vertexOffset + 9] = y2;
+    vertices[vertexOffset + 10] = z2;
+    vertices[vertexOffset + 11] = cr[1];
+    vertices[vertexOffset + 12] = cg[1];
+    vertices[vertexOffset + 13] = cb[1];
+    vertices[vertexOffset + 14] = (l2 >> 8) & 0xFF;
+    vertices[vertexOffset + 15] = l2 & 0xFF;
+    vertices[vertexOffset + 16] = x3;
+    vertices[vertexOffset + 17] = y3;
+    vertices[vertexOffset + 18] = z3;
+    vertices[vertexOffset + 19] = cr[2];
+    vertices[vertexOffset + 20] = cg[2];
+    vertices[vertexOffset + 21] = cb[2];
+    vertices[vertexOffset + 22] = (l3 >> 8) & 0xFF;
+    vertices[vertexOffset + 23] = l3 & 0xFF;
+    vertices[vertexOffset + 24] = x4;
+    vertices[vertexOffset + 25] = y4;
+    vertices[vertexOffset + 26] = z4;
+    vertices[vertexOffset + 27] = cr[3];
+    vertices[vertexOffset + 28] = cg[3];
+    vertices[vertexOffset + 29] = cb[3];
+    vertices[vertexOffset + 30] = (l4 >> 8) & 0xFF;
+    vertices[vertexOffset + 31] = l4 & 0xFF;
+  }
+  if (indices != 0) {
+    indices[indexOffset] = vertex + flipFace;
+    indices[indexOffset + 1] = vertex + flipFace + 1;
+    indices[indexOffset + 2] = vertex + flipFace + 2;
+    indices[indexOffset + 3] = vertex + flipFace + 2;
+    indices[indexOffset + 4] = vertex + ((flipFace + 3) % 4);
+    indices[indexOffset + 5] = vertex + flipFace;
+  }
   growBox(box, x1, y1, z1);
   growBox(box, x2, y2, z2);
   growBox(box, x3, y3, z3);
   growBox(box, x4, y4, z4);
 }
 
-void generate(
+static void getSideLight(
   const World* world,
-  int* heightmap,
-  unsigned char* voxels,
-  const int seed,
-  const unsigned char type
+  const Voxels* voxels,
+  const Side* side,
+  const int* position,
+  unsigned int* light
 ) {
-  fnl_state noise = fnlCreateState();
-  noise.seed = seed;
-  noise.fractal_type = FNL_FRACTAL_FBM;
-  for (int z = 0, voxel = 0; z < world->depth; z++) {
-    for (int y = 0; y < world->height; y++) {
-      for (int x = 0; x < world->width; x++, voxel += VOXELS_STRIDE) {
-        if (
-          x < 32 || x >= world->width - 32
-          || z < 32 || z >= world->depth - 32
-        ) {
-          continue;
-        }
-        const float n = _fnlFastAbs(fnlGetNoise3D(&noise, x, y, z));
-        unsigned char isBlock;
-        switch (type) {
-          case 0: // Default
-            isBlock = y <= (n * world->height);
-            break;
-          case 1: { // Sphere
-            const int cx = world->width * 0.5 - x;
-            const int cy = world->height * 0.5 - y;
-            const int cz = world->depth * 0.5 - z;
-            isBlock = (
-              y < world->height - 32
-              && n > 0.1f
-              && (y < 8 || sqrt(cx * cx + cz * cz) >= world->width * 0.05f)
-              && sqrt(cx * cx + cy * cy + cz * cz) <= world->width * 0.425f
-            );
-          }
-            break;
-        }
-        if (isBlock) {
-          const unsigned int color = getColorFromNoise(0xFF * n);
-          const int heightmapIndex = z * world->width + x;
-          voxels[voxel] = TYPE_STONE;
-          voxels[voxel + VOXEL_R] = (color >> 16) & 0xFF;
-          voxels[voxel + VOXEL_G] = (color >> 8) & 0xFF;
-          voxels[voxel + VOXEL_B] = color & 0xFF;
-          if (heightmap[heightmapIndex] < y) {
-            heightmap[heightmapIndex] = y;
-          }
-        }
-      }
+  int plane[3] = { position[0], position[1], position[2] };
+  plane[side->axis] += side->direction;
+  const int voxel = getVoxel(world, plane[0], plane[1], plane[2]);
+  // Neighbors on the face plane: [0] is at -1 and [1] is at +1
+  int u[2], v[2], diagonal[4];
+  for (unsigned char i = 0; i < 2; i++) {
+    const int d = i ? 1 : -1;
+    int n[3] = { plane[0], plane[1], plane[2] };
+    n[side->u] += d;
+    u[i] = getVoxel(world, n[0], n[1], n[2]);
+    for (unsigned char j = 0; j < 2; j++) {
+      int m[3] = { n[0], n[1], n[2] };
+      m[side->v] += j ? 1 : -1;
+      diagonal[i * 2 + j] = getVoxel(world, m[0], m[1], m[2]);
     }
+    n[side->u] -= d;
+    n[side->v] += d;
+    v[i] = getVoxel(world, n[0], n[1], n[2]);
+  }
+  int corners[16];
+  for (unsigned char c = 0; c < 4; c++) {
+    const unsigned char cu = side->corners[c * 2],
+                        cv = side->corners[c * 2 + 1];
+    getCornerLight(
+      world,
+      voxels,
+      getLight(world, voxels, voxel, VOXEL_LIGHT),
+      getLight(world, voxels, voxel, VOXEL_SUNLIGHT),
+      u[cu],
+      v[cv],
+      diagonal[cu * 2 + cv],
+      &corners[c * 4]
+    );
+  }
+  // Average the light of the 4 corners at once
+  const simd_f32 count = simdF32FromInts(corners[3], corners[7], corners[11], corners[15]),
+                 max = simdF32Splat(maxLight),
+                 scale = simdF32Splat(0xFF);
+  int avgLight[4], avgSunlight[4];
+  simdF32ToInts(
+    simdF32Mul(simdF32Div(simdF32Div(
+      simdF32FromInts(corners[1], corners[5], corners[9], corners[13]),
+      count
+    ), max), scale),
+    avgLight
+  );
+  simdF32ToInts(
+    simdF32Mul(simdF32Div(simdF32Div(
+      simdF32FromInts(corners[2], corners[6], corners[10], corners[14]),
+      count
+    ), max), scale),
+    avgSunlight
+  );
+  for (unsigned char c = 0; c < 4; c++) {
+    light[c] = (corners[c * 4] << 16) | (avgLight[c] << 8) | avgSunlight[c];
   }
 }
 
-void propagate(
-  const World* world,
-  const int* heightmap,
-  unsigned char* voxels,
-  int* queueA,
-  int* queueB
+static void pushSide(
+  unsigned char* box,
+  unsigned int* faces,
+  unsigned int* indices,
+  unsigned char* vertices,
+  unsigned char* colors,
+  const int chunkX, const int chunkY, const int chunkZ,
+  const Side* side,
+  const int* position,
+  const unsigned char width,
+  const unsigned char height,
+  const unsigned char r, const unsigned char g, const unsigned char b,
+  const unsigned int* light
 ) {
-  unsigned int queueSize = 0;
-  for (int z = 0, voxel = 0; z < world->depth; z++) {
-    for (int x = 0; x < world->width; x++, voxel += VOXELS_STRIDE) {
-      const int voxel = getVoxel(world, x, world->height - 1, z);
-      if (voxels[voxel] == TYPE_AIR) {
-        voxels[voxel + VOXEL_SUNLIGHT] = maxLight;
-        queueA[queueSize++] = voxel;
-      }
-    }
+  int corners[12];
+  for (unsigned char c = 0; c < 4; c++) {
+    int* corner = &corners[c * 3];
+    corner[0] = position[0];
+    corner[1] = position[1];
+    corner[2] = position[2];
+    if (side->direction > 0) corner[side->axis]++;
+    corner[side->u] += side->corners[c * 2] * width;
+    corner[side->v] += side->corners[c * 2 + 1] * height;
   }
-  floodLight(
-    VOXEL_SUNLIGHT,
-    world,
-    heightmap,
-    voxels,
-    queueA,
-    queueSize,
-    queueB
+  pushFace(
+    box,
+    faces,
+    indices,
+    vertices,
+    colors,
+    chunkX, chunkY, chunkZ,
+    r, g, b,
+    corners[0], corners[1], corners[2], light[0],
+    corners[3], corners[4], corners[5], light[1],
+    corners[6], corners[7], corners[8], light[2],
+    corners[9], corners[10], corners[11], light[3]
   );
 }
 
-static const int sandNeighbors[] = {
-  0, 0,
-  1, 0,
-  -1, 0,
-  0, 1,
-  0, -1
-};
+static void getBounds(
+  const unsigned char* box,
+  float* bounds
+) {
+  bounds[0] = 0.5f * (box[0] + box[3]);
+  bounds[1] = 0.5f * (box[1] + box[4]);
+  bounds[2] = 0.5f * (box[2] + box[5]);
+  const float halfWidth = 0.5f * (box[3] - box[0]),
+              halfHeight = 0.5f * (box[4] - box[1]),
+              halfDepth = 0.5f * (box[5] - box[2]);
+  bounds[3] = sqrt(
+    halfWidth * halfWidth
+    + halfHeight * halfHeight
+    + halfDepth * halfDepth
+  );
+}
 
-void simulate(
+static const unsigned char buildMasks(
   const World* world,
-  const int* heightmap,
-  unsigned char* voxels,
-  const unsigned int step
+  const Voxels* voxels,
+  unsigned long long* masks,
+  const unsigned char chunkSize,
+  const int chunkX,
+  const int chunkY,
+  const int chunkZ
 ) {
-  // Be aware that running this will make the heightmap data invalid.
-  // This method could prolly update it but since it's not needed for
-  // the animation test I decided not update it here.
-  const unsigned char invZ = (step % 4) < 2;
-  const unsigned char invX = (step % 2) == 0;
-  for (int y = 1; y < world->height; y++) {
-    for (int sz = 2; sz < world->depth - 2; sz++) {
-      const int z = invZ ? world->depth - 1 - sz : sz;
-      for (int sx = 2; sx < world->width - 2; sx++) {
-        const int x = invX ? world->width - 1 - sx : sx;
-        const int voxel = getVoxel(world, x, y, z);
-        if (voxels[voxel] != TYPE_SAND) {
-          continue;
-        }
-        int neighbor;
-        for (unsigned char n = 0; n < 10; n += 2) {
-          neighbor = getVoxel(world, x + sandNeighbors[n], y - 1, z + sandNeighbors[n + 1]);
-          if (neighbor != -1 && voxels[neighbor] == TYPE_AIR) {
-            break;
-          }
-        }
-        if (neighbor == -1 || voxels[neighbor] != TYPE_AIR) {
-          voxels[voxel] = TYPE_STONE;
-          continue;
-        }
-        voxels[neighbor] = voxels[voxel];
-        voxels[neighbor + VOXEL_R] = voxels[voxel + VOXEL_R];
-        voxels[neighbor + VOXEL_G] = voxels[voxel + VOXEL_G];
-        voxels[neighbor + VOXEL_B] = voxels[voxel + VOXEL_B];
-        voxels[voxel] = 0;
-        voxels[voxel + VOXEL_R] = 0;
-        voxels[voxel + VOXEL_G] = 0;
-        voxels[voxel + VOXEL_B] = 0;
-        for (int n = 0; n < 10; n += 2) {
-          neighbor = getVoxel(world, x + sandNeighbors[n], y + 1, z + sandNeighbors[n + 1]);
-          if (neighbor != -1 && voxels[neighbor] == TYPE_STONE) {
-            voxels[neighbor] = TYPE_SAND;
-          }
+  // One 64bit occupancy mask per (y, z) row of the chunk plus a 1 voxel apron.
+  // Bit i is set when the voxel at chunkX - 1 + i is solid or out of bounds,
+  // since faces facing out of the world don't get meshed.
+  const unsigned int stride = chunkSize + 2;
+  const unsigned long long apron = (1ULL << stride) - 1;
+  unsigned long long solid = 0;
+  for (int z = 0, m = 0; z < stride; z++) {
+    for (int y = 0; y < stride; y++, m++) {
+      const int wy = chunkY + y - 1,
+                wz = chunkZ + z - 1;
+      if (wy < 0 || wy >= world->height || wz < 0 || wz >= world->depth) {
+        masks[m] = apron;
+        continue;
+      }
+      unsigned long long mask = 0;
+      int voxel = getVoxel(world, chunkX, wy, wz);
+      for (int x = 1; x <= chunkSize; voxel = getNextVoxel(world, voxel, chunkX + x - 1), x++) {
+        if (getType(world, voxels, voxel) != TYPE_AIR) {
+          mask |= 1ULL << x;
         }
       }
+      const int west = getVoxel(world, chunkX - 1, wy, wz),
+                east = getVoxel(world, chunkX + chunkSize, wy, wz);
+      if (west == -1 || getType(world, voxels, west) != TYPE_AIR) mask |= 1ULL;
+      if (east == -1 || getType(world, voxels, east) != TYPE_AIR) mask |= 1ULL << (stride - 1);
+      masks[m] = mask;
+      if (y > 0 && y <= chunkSize && z > 0 && z <= chunkSize) {
+        solid |= mask;
+      }
     }
   }
+  return (solid & (apron ^ 1ULL ^ (1ULL << (stride - 1)))) != 0;
 }
 
-void update(
-  const World* world,
-  int* heightmap,
-  unsigned char* voxels,
-  int* queueA,
-  int* queueB,
-  int* queueC,
-  const unsigned char type,
-  const int x,
-  const int y,
-  const int z,
-  const unsigned char r,
-  const unsigned char g,
+static const unsigned char getFacePair(
+  const unsigned char a,
   const unsigned char b
 ) {
-  if (
-    x < 1 || x >= world->width - 1
-    || y < 0 || y >= world->height - 1
-    || z < 1 || z >= world->depth - 1
-  ) {
-    return;
+  // Bit of the pair of faces (in the order of neighbors[]) in the 15 bit visibility masks
+  const unsigned char min = a < b ? a : b,
+                      max = a < b ? b : a;
+  return min * (11 - min) / 2 + max - min - 1;
+}
+
+static inline const unsigned int fillRow(
+  unsigned int bits,
+  const unsigned int air
+) {
+  // Grows the bits through the runs of air they're in, both ways, in log2(32) steps
+  unsigned int up = bits,
+               down = bits,
+               upAir = air,
+               downAir = air;
+  for (unsigned char shift = 1; shift < 32; shift <<= 1) {
+    up |= upAir & (up << shift);
+    down |= downAir & (down >> shift);
+    upAir &= upAir << shift;
+    downAir &= downAir >> shift;
   }
-  const int voxel = getVoxel(world, x, y, z);
-  const int heightmapIndex = z * world->width + x;
-  const int height = heightmap[heightmapIndex];
-  const unsigned char current = voxels[voxel];
-  if (type == TYPE_AIR) {
-    if (y == height) {
-      for (int h = y - 1; h >= 0; h --) {
-        if (h == 0 || voxels[getVoxel(world, x, h, z)] != TYPE_AIR) {
-          heightmap[heightmapIndex] = h;
-          break;
-        }
-      }
+  return up | down;
+}
+
+static inline const unsigned int getFaceBits(
+  const unsigned char face,
+  const unsigned int size,
+  const unsigned int y,
+  const unsigned int z
+) {
+  // The bits of the (y, z) row that lay on a face of the chunk
+  switch (face) {
+    case 0: return 1u << (size - 1);
+    case 1: return 1u;
+    case 2: return z == size - 1 ? 0xFFFFFFFF : 0;
+    case 3: return z == 0 ? 0xFFFFFFFF : 0;
+    case 4: return y == size - 1 ? 0xFFFFFFFF : 0;
+    default: return y == 0 ? 0xFFFFFFFF : 0;
+  }
+}
+
+static const unsigned char floodSlice(
+  const unsigned int* air,
+  unsigned int* reached,
+  const unsigned int size,
+  const unsigned int z,
+  const unsigned char reverse
+) {
+  // Grows the reached air of the rows of a z slice from their neighbors.
+  // Returns 1 if any of them grew.
+  unsigned char grew = 0;
+  for (unsigned int i = 0; i < size; i++) {
+    const unsigned int y = reverse ? size - 1 - i : i,
+                       r = z * size + y;
+    unsigned int bits = reached[r];
+    if (y > 0) bits |= reached[r - 1];
+    if (y < size - 1) bits |= reached[r + 1];
+    if (z > 0) bits |= reached[r - size];
+    if (z < size - 1) bits |= reached[r + size];
+    bits = fillRow(bits & air[r], air[r]);
+    if (bits != reached[r]) {
+      reached[r] = bits;
+      grew = 1;
     }
-  } else if (height < y) {
-    heightmap[heightmapIndex] = y;
   }
-  voxels[voxel] = type;
-  voxels[voxel + VOXEL_R] = r;
-  voxels[voxel + VOXEL_G] = g;
-  voxels[voxel + VOXEL_B] = b;
-  if (current == TYPE_LIGHT) {
-    const unsigned char light = voxels[voxel + VOXEL_LIGHT];
-    voxels[voxel + VOXEL_LIGHT] = 0;
-    queueA[0] = voxel;
-    queueA[1] = light;
-    removeLight(
-      VOXEL_LIGHT,
-      world,
-      heightmap,
-      voxels,
-      queueA,
-      2,
-      queueB,
-      queueC,
-      0
-    );
-  } else if (current == TYPE_AIR && type != TYPE_AIR) {
-    for (unsigned char channel = VOXEL_LIGHT; channel <= VOXEL_SUNLIGHT; channel++) {
-      const unsigned char light = voxels[voxel + channel];
-      if (light != 0) {
-        voxels[voxel + channel] = 0;
-        queueA[0] = voxel;
-        queueA[1] = light;
-        removeLight(
-          channel,
-          world,
-          heightmap,
-          voxels,
-          queueA,
-          2,
-          queueB,
-          queueC,
-          0
-        );
-      }
+  return grew;
+}
+
+static const unsigned int getVisibility(
+  const unsigned long long* masks,
+  const unsigned char chunkSize
+) {
+  // Floods every region of air that touches the faces of the chunk, using the
+  // occupancy masks from buildMasks, and returns the pairs of faces they connect.
+  // The rows are 32bit masks of air along x, one per (y, z) of the chunk.
+  // Every flood sweeps the z slices back and forth until it stops growing,
+  // but only across the range the region has reached so far.
+  const unsigned int stride = chunkSize + 2,
+                     size = chunkSize,
+                     full = size == 32 ? 0xFFFFFFFF : (1u << size) - 1;
+  unsigned int air[MAX_CHUNK_SIZE * MAX_CHUNK_SIZE],
+               flooded[MAX_CHUNK_SIZE * MAX_CHUNK_SIZE],
+               reached[MAX_CHUNK_SIZE * MAX_CHUNK_SIZE];
+  for (unsigned int z = 0, r = 0; z < size; z++) {
+    for (unsigned int y = 0; y < size; y++, r++) {
+      air[r] = ~(unsigned int) (masks[(z + 1) * stride + y + 1] >> 1) & full;
+      flooded[r] = reached[r] = 0;
     }
   }
-  if (type == TYPE_LIGHT) {
-    voxels[voxel + VOXEL_LIGHT] = maxLight;
-    queueA[0] = voxel;
-    floodLight(
-      VOXEL_LIGHT,
-      world,
-      heightmap,
-      voxels,
-      queueA,
-      1,
-      queueB
-    );
-  } else if (type == TYPE_AIR && current != TYPE_AIR) {
-    unsigned int lightQueue = 0;
-    unsigned int sunlightQueue = 0;
-    for (unsigned char n = 0; n < 6; n += 1) {
-      const int neighbor = getVoxel(
-        world,
-        x + neighbors[n * 3],
-        y + neighbors[n * 3 + 1],
-        z + neighbors[n * 3 + 2]
-      );
-      if (neighbor != -1) {
-        if (voxels[neighbor + VOXEL_LIGHT] != 0) {
-          queueA[lightQueue++] = neighbor;
-        }
-        if (voxels[neighbor + VOXEL_SUNLIGHT] != 0) {
-          queueB[sunlightQueue++] = neighbor;
+  unsigned int visibility = 0;
+  for (unsigned char face = 0; face < 6; face++) {
+    for (unsigned int z = 0, r = 0; z < size; z++) {
+      for (unsigned int y = 0; y < size; y++, r++) {
+        unsigned int seeds;
+        while ((seeds = air[r] & getFaceBits(face, size, y, z) & ~flooded[r]) != 0) {
+          reached[r] = fillRow(seeds & -seeds, air[r]);
+          // The sweeps go one slice past the range, so it grows as they go
+          int from = z, to = z;
+          for (unsigned int pass = 0, grew = 1; grew; pass++) {
+            grew = 0;
+            if (pass & 1) {
+              for (int cz = to < (int) size - 1 ? to + 1 : to; cz >= from - 1 && cz >= 0; cz--) {
+                if (floodSlice(air, reached, size, cz, 1)) {
+                  grew = 1;
+                  if (cz < from) from = cz;
+                  if (cz > to) to = cz;
+                }
+              }
+            } else {
+              for (int cz = from > 0 ? from - 1 : 0; cz <= to + 1 && cz < (int) size; cz++) {
+                if (floodSlice(air, reached, size, cz, 0)) {
+                  grew = 1;
+                  if (cz < from) from = cz;
+                  if (cz > to) to = cz;
+                }
+              }
+            }
+          }
+          unsigned char touched = 0;
+          for (int cz = from; cz <= to; cz++) {
+            for (unsigned int cy = 0; cy < size; cy++) {
+              const unsigned int cr = cz * size + cy;
+              for (unsigned char f = 0; f < 6; f++) {
+                if (reached[cr] & getFaceBits(f, size, cy, cz)) touched |= 1 << f;
+              }
+              flooded[cr] |= reached[cr];
+              reached[cr] = 0;
+            }
+          }
+          for (unsigned char a = 0; a < 6; a++) {
+            for (unsigned char b = a + 1; b < 6; b++) {
+              if ((touched >> a) & (touched >> b) & 1) {
+                visibility |= 1u << getFacePair(a, b);
+              }
+            }
+          }
         }
       }
     }
-    if (lightQueue > 0) {
-      floodLight(
-        VOXEL_LIGHT,
-        world,
-        heightmap,
-        voxels,
-        queueA,
-        lightQueue,
-        queueC
-      );
-    }
-    if (sunlightQueue > 0) {
-      floodLight(
-        VOXEL_SUNLIGHT,
-        world,
-        heightmap,
-        voxels,
-        queueB,
-        sunlightQueue,
-        queueC
-      );
-    }
-    
   }
+  return visibility;
 }
 
-const int mesh(
+static const unsigned long long getSideMask(
+  const unsigned long long* masks,
+  const unsigned char chunkSize,
+  const unsigned char side,
+  const int y,
+  const int z
+) {
+  // Returns the bits of the row at local (y, z) that have an exposed face
+  // on the requested side. Coordinates are offset by the apron.
+  const unsigned int stride = chunkSize + 2;
+  const unsigned long long row = masks[z * stride + y],
+                           solid = row & (((1ULL << chunkSize) - 1) << 1);
+  switch (side) {
+    case 0: // top
+      return solid & ~masks[z * stride + y + 1];
+    case 1: // bottom
+      return solid & ~masks[z * stride + y - 1];
+    case 2: // south
+      return solid & ~masks[(z + 1) * stride + y];
+    case 3: // north
+      return solid & ~masks[(z - 1) * stride + y];
+    case 4: // east
+      return solid & ~(row >> 1);
+    default: // west
+      return solid & ~(row << 1);
+  }
+}
+
+static const int meshGreedy(
   const World* world,
-  const unsigned char* voxels,
+  const Voxels* voxels,
+  const unsigned long long* masks,
   float* bounds,
   unsigned int* indices,
   unsigned char* vertices,
+  unsigned char* colors,
   const unsigned char chunkSize,
   const int chunkX,
   const int chunkY,
   const int chunkZ
 ) {
-  if (
-    chunkX < 0
-    || chunkY < 0
-    || chunkZ < 0
-    || chunkX + chunkSize > world->width
-    || chunkY + chunkSize > world->height
-    || chunkZ + chunkSize > world->depth
-  ) {
-    return -1;
-  }
-  // WELCOME TO THE JUNGLE !!
+  // Faces are only merged when all four corners have the same AO and light
+  // values, so the merged quads interpolate exactly like the unmerged ones.
+  // Any other face gets pushed right away as a 1x1 quad.
+  // Each mask entry holds the face color (with a presence bit) and its light.
+  unsigned int mask[MAX_CHUNK_SIZE * MAX_CHUNK_SIZE * 2];
+  // The exposed faces of every (y, z) row of the chunk for the current side
+  unsigned long long exposed[MAX_CHUNK_SIZE * MAX_CHUNK_SIZE];
   unsigned char box[6] = { chunkSize, chunkSize, chunkSize, 0, 0, 0 };
   unsigned int faces = 0;
-  for (int z = chunkZ; z < chunkZ + chunkSize; z++) {
-    for (int y = chunkY; y < chunkY + chunkSize; y++) {
-      for (int x = chunkX; x < chunkX + chunkSize; x++) {
-        const int voxel = getVoxel(world, x, y, z);
-        if (voxels[voxel] == TYPE_AIR) {
-          continue;
+  const int chunk[3] = { chunkX, chunkY, chunkZ };
+  for (unsigned char s = 0; s < 6; s++) {
+    const Side* side = &sides[s];
+    for (int z = 0, r = 0; z < chunkSize; z++) {
+      for (int y = 0; y < chunkSize; y++, r++) {
+        exposed[r] = getSideMask(masks, chunkSize, s, y + 1, z + 1);
+      }
+    }
+    for (int d = 0; d < chunkSize; d++) {
+      for (int j = 0, m = 0; j < chunkSize; j++) {
+        for (int i = 0; i < chunkSize; i++, m += 2) {
+          mask[m] = 0;
+          int local[3];
+          local[side->axis] = d;
+          local[side->u] = i;
+          local[side->v] = j;
+          if (!((exposed[local[2] * chunkSize + local[1]] >> (local[0] + 1)) & 1ULL)) {
+            continue;
+          }
+          const int position[3] = {
+            chunkX + local[0],
+            chunkY + local[1],
+            chunkZ + local[2],
+          };
+          const unsigned int color = getColor(world, voxels, getVoxel(world, position[0], position[1], position[2]));
+          unsigned int light[4];
+          getSideLight(world, voxels, side, position, light);
+          if (light[0] != light[1] || light[0] != light[2] || light[0] != light[3]) {
+            pushSide(
+              box,
+              &faces,
+              indices,
+              vertices,
+              colors,
+              chunkX, chunkY, chunkZ,
+              side,
+              position,
+              1, 1,
+              (color >> 16) & 0xFF, (color >> 8) & 0xFF, color & 0xFF,
+              light
+            );
+            continue;
+          }
+          mask[m] = 0x1000000 | color;
+          mask[m + 1] = light[0];
         }
-        const unsigned char r = voxels[voxel + VOXEL_R],
-                            g = voxels[voxel + VOXEL_G],
-                            b = voxels[voxel + VOXEL_B];
-        const int top = getVoxel(world, x, y + 1, z),
-                  bottom = getVoxel(world, x, y - 1, z),
-                  south = getVoxel(world, x, y, z + 1),
-                  north = getVoxel(world, x, y, z - 1),
-                  east = getVoxel(world, x + 1, y, z),
-                  west = getVoxel(world, x - 1, y, z);
-        if (top != -1 && voxels[top] == TYPE_AIR) {
-          const unsigned char light = voxels[top + VOXEL_LIGHT];
-          const unsigned char sunlight = voxels[top + VOXEL_SUNLIGHT];
-          const int ts = getVoxel(world, x, y + 1, z + 1),
-                    tn = getVoxel(world, x, y + 1, z - 1),
-                    te = getVoxel(world, x + 1, y + 1, z),
-                    tw = getVoxel(world, x - 1, y + 1, z);
-          pushFace(
+      }
+      for (int j = 0; j < chunkSize; j++) {
+        for (int i = 0; i < chunkSize; i++) {
+          const int m = (j * chunkSize + i) * 2;
+          const unsigned int color = mask[m],
+                             light = mask[m + 1];
+          if (color == 0) {
+            continue;
+          }
+          unsigned char width = 1;
+          while (
+            i + width < chunkSize
+            && mask[m + width * 2] == color
+            && mask[m + width * 2 + 1] == light
+          ) {
+            width++;
+          }
+          unsigned char height = 1;
+          for (; j + height < chunkSize; height++) {
+            const int row = ((j + height) * chunkSize + i) * 2;
+            unsigned char w = 0;
+            while (
+              w < width
+              && mask[row + w * 2] == color
+              && mask[row + w * 2 + 1] == light
+            ) {
+              w++;
+            }
+            if (w < width) {
+              break;
+            }
+          }
+          for (int h = 0; h < height; h++) {
+            for (int w = 0; w < width; w++) {
+              mask[((j + h) * chunkSize + i + w) * 2] = 0;
+            }
+          }
+          int position[3];
+          position[side->axis] = chunk[side->axis] + d;
+          position[side->u] = chunk[side->u] + i;
+          position[side->v] = chunk[side->v] + j;
+          const unsigned int corners[4] = { light, light, light, light };
+          pushSide(
             box,
             &faces,
             indices,
             vertices,
+            colors,
             chunkX, chunkY, chunkZ,
-            r, g, b,
-            x, y + 1, z + 1,
-            getLight(voxels, light, sunlight, tw, ts, getVoxel(world, x - 1, y + 1, z + 1)),
-            x + 1, y + 1, z + 1,
-            getLight(voxels, light, sunlight, te, ts, getVoxel(world, x + 1, y + 1, z + 1)),
-            x + 1, y + 1, z,
-            getLight(voxels, light, sunlight, te, tn, getVoxel(world, x + 1, y + 1, z - 1)),
-            x, y + 1, z,
-            getLight(voxels, light, sunlight, tw, tn, getVoxel(world, x - 1, y + 1, z - 1))
+            side,
+            position,
+            width, height,
+            (color >> 16) & 0xFF, (color >> 8) & 0xFF, color & 0xFF,
+            corners
           );
         }
-        if (bottom != -1 && voxels[bottom] == TYPE_AIR) {
-          const unsigned char light = voxels[bottom + VOXEL_LIGHT];
-          const unsigned char sunlight = voxels[bottom + VOXEL_SUNLIGHT];
-          const int bs = getVoxel(world, x, y - 1, z + 1),
-                    bn = getVoxel(world, x, y - 1, z - 1),
-                    be = getVoxel(world, x + 1, y - 1, z),
-                    bw = getVoxel(world, x - 1, y - 1, z);
-          pushFace(
-            box,
-            &faces,
-            indices,
-            vertices,
-            chunkX, chunkY, chunkZ,
-            r, g, b,
-            x, y, z,
-            getLight(voxels, light, sunlight, bw, bn, getVoxel(world, x - 1, y - 1, z - 1)),
-            x + 1, y, z,
-            getLight(voxels, light, sunlight, be, bn, getVoxel(world, x + 1, y - 1, z - 1)),
-            x + 1, y, z + 1,
-            getLight(voxels, light, sunlight, be, bs, getVoxel(world, x + 1, y - 1, z + 1)),
-            x, y, z + 1,
-            getLight(voxels, light, sunlight, bw, bs, getVoxel(world, x - 1, y - 1, z + 1))
-          );
+      }
+    }
+  }
+  getBounds(box, bounds);
+  return faces;
+}
+
+enum GenerateFlags {
+  GENERATE_INTERPOLATED = 1
+};
+
+// Spacing of the noise lattice of the interpolated generation
+#define GENERATE_LATTICE 4
+
+static void generateBlock(
+  const World* world,
+  int* heightmap,
+  Voxels* voxels,
+  const unsigned char type,
+  const int x,
+  const int y,
+  const int z,
+  const float n
+) {
+  unsigned char isBlock;
+  switch (type) {
+    case 0: // Default
+      isBlock = y <= (n * world->height);
+      break;
+    case 1: { // Sphere
+      const int cx = world->width * 0.5 - x;
+      const int cy = world->height * 0.5 - y;
+      const int cz = world->depth * 0.5 - z;
+      isBlock = (
+        y < world->height - 32
+        && n > 0.1f
+        && (y < 8 || sqrt(cx * cx + cz * cz) >= world->width * 0.05f)
+        && sqrt(cx * cx + cy * cy + cz * cz) <= world->width * 0.425f
+      );
+    }
+      break;
+    default:
+      isBlock = 0;
+      break;
+  }
+  if (isBlock) {
+    const unsigned int color = getColorFromNoise(0xFF * n);
+    const int heightmapIndex = z * world->width + x;
+    setBlock(world, voxels, getVoxel(world, x, y, z), TYPE_STONE, color);
+    if (heightmap[heightmapIndex] < y) {
+      heightmap[heightmapIndex] = y;
+    }
+  }
+}
+
+static void sampleLatticeRow(
+  fnl_state* noise,
+  float* row,
+  const int fromX,
+  const int cells,
+  const int y,
+  const int z
+) {
+  // Samples the lattice points from the voxel fromX (which must be on the lattice) up
+  for (int x = 0; x <= cells; x++) {
+    row[x] = fnlGetNoise3D(noise, fromX + x * GENERATE_LATTICE, y * GENERATE_LATTICE, z);
+  }
+}
+
+void generateRegion(
+  const World* world,
+  int* heightmap,
+  Voxels* voxels,
+  const int seed,
+  const unsigned char type,
+  const unsigned char flags,
+  const int originX,
+  const int originZ,
+  const int fromX,
+  const int toX,
+  const int fromZ,
+  const int toZ
+) {
+  // Generates the voxels of the columns in [fromX, toX) x [fromZ, toZ), sampling
+  // the noise at (originX + x, y, originZ + z). The world streaming moves the
+  // origin, which must be a multiple of GENERATE_LATTICE, so the terrain stays put.
+  // It only writes those voxels and heightmap columns, so the regions can run in
+  // parallel with the dense layouts (the palette layout allocates from a shared pool).
+  // With GENERATE_INTERPOLATED it samples the noise on a lattice and
+  // trilinearly interpolates it inside the cells. The lattice is global,
+  // so the output doesn't depend on how the world is split into regions.
+  if (fromX >= toX || fromZ >= toZ) {
+    return;
+  }
+  fnl_state noise = fnlCreateState();
+  noise.seed = seed;
+  noise.fractal_type = FNL_FRACTAL_FBM;
+  if (!(flags & GENERATE_INTERPOLATED)) {
+    for (int z = fromZ; z < toZ; z++) {
+      for (int y = 0; y < world->height; y++) {
+        for (int x = fromX; x < toX; x++) {
+          const float n = _fnlFastAbs(fnlGetNoise3D(&noise, originX + x, y, originZ + z));
+          generateBlock(world, heightmap, voxels, type, x, y, z, n);
         }
-        if (south != -1 && voxels[south] == 0) {
-          const unsigned char light = voxels[south + VOXEL_LIGHT];
-          const unsigned char sunlight = voxels[south + VOXEL_SUNLIGHT];
-          const int st = getVoxel(world, x, y + 1, z + 1),
-                    sb = getVoxel(world, x, y - 1, z + 1),
-                    se = getVoxel(world, x + 1, y, z + 1),
-                    sw = getVoxel(world, x - 1, y, z + 1);
-          pushFace(
-            box,
-            &faces,
-            indices,
-            vertices,
-            chunkX, chunkY, chunkZ,
-            r, g, b,
-            x, y, z + 1,
-            getLight(voxels, light, sunlight, sw, sb, getVoxel(world, x - 1, y - 1, z + 1)),
-            x + 1, y, z + 1,
-            getLight(voxels, light, sunlight, se, sb, getVoxel(world, x + 1, y - 1, z + 1)),
-            x + 1, y + 1, z + 1,
-            getLight(voxels, light, sunlight, se, st, getVoxel(world, x + 1, y + 1, z + 1)),
-            x, y + 1, z + 1,
-            getLight(voxels, light, sunlight, sw, st, getVoxel(world, x - 1, y + 1, z + 1))
-          );
+      }
+    }
+    return;
+  }
+  const int firstCell = fromX / GENERATE_LATTICE,
+            cellsX = (toX + GENERATE_LATTICE - 1) / GENERATE_LATTICE - firstCell,
+            cellsY = (world->height + GENERATE_LATTICE - 1) / GENERATE_LATTICE;
+  // The 4 lattice rows around the current cells:
+  // [0] y, z [1] y + 1, z [2] y, z + 1 [3] y + 1, z + 1
+  float rows[4][cellsX + 1];
+  for (int cz = fromZ / GENERATE_LATTICE; cz * GENERATE_LATTICE < toZ; cz++) {
+    const int rowX = originX + firstCell * GENERATE_LATTICE,
+              rowZ = originZ + cz * GENERATE_LATTICE;
+    sampleLatticeRow(&noise, rows[0], rowX, cellsX, 0, rowZ);
+    sampleLatticeRow(&noise, rows[2], rowX, cellsX, 0, rowZ + GENERATE_LATTICE);
+    const int cellMinZ = cz * GENERATE_LATTICE > fromZ ? cz * GENERATE_LATTICE : fromZ,
+              cellMaxZ = (cz + 1) * GENERATE_LATTICE < toZ ? (cz + 1) * GENERATE_LATTICE : toZ;
+    for (int cy = 0; cy < cellsY; cy++) {
+      sampleLatticeRow(&noise, rows[1], rowX, cellsX, cy + 1, rowZ);
+      sampleLatticeRow(&noise, rows[3], rowX, cellsX, cy + 1, rowZ + GENERATE_LATTICE);
+      const int cellMaxY = (cy + 1) * GENERATE_LATTICE < world->height ? (cy + 1) * GENERATE_LATTICE : world->height;
+      for (int z = cellMinZ; z < cellMaxZ; z++) {
+        const float fz = (float) (z - cz * GENERATE_LATTICE) / GENERATE_LATTICE;
+        for (int y = cy * GENERATE_LATTICE; y < cellMaxY; y++) {
+          const float fy = (float) (y - cy * GENERATE_LATTICE) / GENERATE_LATTICE;
+          for (int x = fromX; x < toX; x++) {
+            const int cx = x / GENERATE_LATTICE,
+                      c = cx - firstCell;
+            const float fx = (float) (x - cx * GENERATE_LATTICE) / GENERATE_LATTICE;
+            const float y0 = (
+              (rows[0][c] + (rows[0][c + 1] - rows[0][c]) * fx) * (1.0f - fy)
+              + (rows[1][c] + (rows[1][c + 1] - rows[1][c]) * fx) * fy
+            );
+            const float y1 = (
+              (rows[2][c] + (rows[2][c + 1] - rows[2][c]) * fx) * (1.0f - fy)
+              + (rows[3][c] + (rows[3][c + 1] - rows[3][c]) * fx) * fy
+            );
+            const float n = _fnlFastAbs(y0 + (y1 - y0) * fz);
+            generateBlock(world, heightmap, voxels, type, x, y, z, n);
+          }
         }
-        if (north != -1 && voxels[north] == TYPE_AIR) {
-          const unsigned char light = voxels[north + VOXEL_LIGHT];
-          const unsigned char sunlight = voxels[north + VOXEL_SUNLIGHT];
-          const int nt = getVoxel(world, x, y + 1, z - 1),
-                    nb = getVoxel(world, x, y - 1, z - 1),
-                    ne = getVoxel(world, x + 1, y, z - 1),
-                    nw = getVoxel(world, x - 1, y, z - 1);
-          pushFace(
-            box,
-            &faces,
-            indices,
-            vertices,
-            chunkX, chunkY, chunkZ,
-            r, g, b,
-            x + 1, y, z,
-            getLight(voxels, light, sunlight, ne, nb, getVoxel(world, x + 1, y - 1, z - 1)),
-            x, y, z,
-            getLight(voxels, light, sunlight, nw, nb, getVoxel(world, x - 1, y - 1, z - 1)),
-            x, y + 1, z,
-            getLight(voxels, light, sunlight, nw, nt, getVoxel(world, x - 1, y + 1, z - 1)),
-            x + 1, y + 1, z,
-            getLight(voxels, light, sunlight, ne, nt, getVoxel(world, x + 1, y + 1, z - 1))
-          );
+      }
+      __builtin_memcpy(rows[0], rows[1], sizeof(rows[0]));
+      __builtin_memcpy(rows[2], rows[3], sizeof(rows[2]));
+    }
+  }
+}
+
+void generateSlab(
+  const World* world,
+  int* heightmap,
+  Voxels* voxels,
+  const int seed,
+  const unsigned char type,
+  const unsigned char flags,
+  const int fromZ,
+  const int toZ
+) {
+  // Generates the voxels in [fromZ, toZ), leaving 32 voxels of air around the world
+  generateRegion(
+    world,
+    heightmap,
+    voxels,
+    seed,
+    type,
+    flags,
+    0,
+    0,
+    32,
+    world->width - 32,
+    fromZ > 32 ? fromZ : 32,
+    toZ < world->depth - 32 ? toZ : world->depth - 32
+  );
+}
+
+void generate(
+  const World* world,
+  int* heightmap,
+  Voxels* voxels,
+  const int seed,
+  const unsigned char type
+) {
+  generateSlab(world, heightmap, voxels, seed, type, 0, 0, world->depth);
+}
+
+#if VOXELS_PALETTE
+static const unsigned char isSunlitChunk(
+  const Voxels* voxels,
+  const int chunk
+) {
+  return (
+    voxels->chunks[chunk].bits == 0
+    && voxels->chunks[chunk].light == 0
+    && voxels->chunks[chunk].uniformLight == (maxLight << 8)
+  );
+}
+
+static void propagateSky(
+  const World* world,
+  const int* heightmap,
+  Voxels* voxels,
+  Queue* queue
+) {
+  // The chunks above the heightmap are all air and the flood would fill them
+  // with sunlight straight down from the sky. Setting their uniform light
+  // directly saves allocating a light plane for each one of them.
+  // Then it only needs to flood from the voxels on their faces that can
+  // light up a voxel in any of the other chunks.
+  const int size = PALETTE_CHUNK_SIZE,
+            chunksX = world->width / size,
+            chunksY = world->height / size,
+            chunksZ = world->depth / size;
+  for (int cz = 0; cz < chunksZ; cz++) {
+    for (int cx = 0; cx < chunksX; cx++) {
+      int top = -1;
+      for (int z = cz * size; z < (cz + 1) * size; z++) {
+        for (int x = cx * size; x < (cx + 1) * size; x++) {
+          if (top < heightmap[z * world->width + x]) top = heightmap[z * world->width + x];
         }
-        if (east != -1 && voxels[east] == TYPE_AIR) {
-          const unsigned char light = voxels[east + VOXEL_LIGHT];
-          const unsigned char sunlight = voxels[east + VOXEL_SUNLIGHT];
-          const int et = getVoxel(world, x + 1, y + 1, z),
-                    eb = getVoxel(world, x + 1, y - 1, z),
-                    es = getVoxel(world, x + 1, y, z + 1),
-                    en = getVoxel(world, x + 1, y, z - 1);
-          pushFace(
-            box,
-            &faces,
-            indices,
-            vertices,
-            chunkX, chunkY, chunkZ,
-            r, g, b,
-            x + 1, y, z + 1,
-            getLight(voxels, light, sunlight, es, eb, getVoxel(world, x + 1, y - 1, z + 1)),
-            x + 1, y, z,
-            getLight(voxels, light, sunlight, en, eb, getVoxel(world, x + 1, y - 1, z - 1)),
-            x + 1, y + 1, z,
-            getLight(voxels, light, sunlight, en, et, getVoxel(world, x + 1, y + 1, z - 1)),
-            x + 1, y + 1, z + 1,
-            getLight(voxels, light, sunlight, es, et, getVoxel(world, x + 1, y + 1, z + 1))
-          );
+      }
+      for (int cy = chunksY - 1; cy >= 0 && cy * size > top; cy--) {
+        PaletteChunk* chunk = &voxels->chunks[(cz * chunksY + cy) * chunksX + cx];
+        if (chunk->bits != 0 || chunk->light != 0 || chunk->uniformLight != 0) {
+          break;
         }
-        if (west != -1 && voxels[west] == TYPE_AIR) {
-          const unsigned char light = voxels[west + VOXEL_LIGHT];
-          const unsigned char sunlight = voxels[west + VOXEL_SUNLIGHT];
-          const int wt = getVoxel(world, x - 1, y + 1, z),
-                    wb = getVoxel(world, x - 1, y - 1, z),
-                    ws = getVoxel(world, x - 1, y, z + 1),
-                    wn = getVoxel(world, x - 1, y, z - 1);
-          pushFace(
-            box,
-            &faces,
-            indices,
-            vertices,
-            chunkX, chunkY, chunkZ,
-            r, g, b,
-            x, y, z,
-            getLight(voxels, light, sunlight, wn, wb, getVoxel(world, x - 1, y - 1, z - 1)),
-            x, y, z + 1,
-            getLight(voxels, light, sunlight, ws, wb, getVoxel(world, x - 1, y - 1, z + 1)),
-            x, y + 1, z + 1,
-            getLight(voxels, light, sunlight, ws, wt, getVoxel(world, x - 1, y + 1, z + 1)),
-            x, y + 1, z,
-            getLight(voxels, light, sunlight, wn, wt, getVoxel(world, x - 1, y + 1, z - 1))
-          );
+        chunk->uniformLight = maxLight << 8;
+      }
+    }
+  }
+  for (int cz = 0, chunk = 0; cz < chunksZ; cz++) {
+    for (int cy = 0; cy < chunksY; cy++) {
+      for (int cx = 0; cx < chunksX; cx++, chunk++) {
+        if (!isSunlitChunk(voxels, chunk)) {
+          continue;
+        }
+        const int origin[3] = { cx * size, cy * size, cz * size };
+        for (unsigned char n = 0; n < 6; n++) {
+          const int* direction = &neighbors[n * 3];
+          const int ncx = cx + direction[0],
+                    ncy = cy + direction[1],
+                    ncz = cz + direction[2];
+          if (
+            ncx < 0 || ncx >= chunksX
+            || ncy < 0 || ncy >= chunksY
+            || ncz < 0 || ncz >= chunksZ
+            || isSunlitChunk(voxels, (ncz * chunksY + ncy) * chunksX + ncx)
+          ) {
+            continue;
+          }
+          const unsigned char axis = direction[0] ? 0 : (direction[1] ? 1 : 2),
+                              u = (axis + 1) % 3,
+                              v = (axis + 2) % 3;
+          for (int i = 0; i < size; i++) {
+            for (int j = 0; j < size; j++) {
+              int position[3];
+              position[axis] = origin[axis] + (direction[axis] > 0 ? size - 1 : 0);
+              position[u] = origin[u] + i;
+              position[v] = origin[v] + j;
+              const int nx = position[0] + direction[0],
+                        ny = position[1] + direction[1],
+                        nz = position[2] + direction[2];
+              // Same rules as floodLight for a voxel at maxLight
+              if (
+                getType(world, voxels, getVoxel(world, nx, ny, nz)) != TYPE_AIR
+                || (n != 5 && ny > heightmap[nz * world->width + nx])
+              ) {
+                continue;
+              }
+              if (queue->size >= queue->capacity / 2) {
+                // There can be more face voxels than the queue fits.
+                // Flooding doesn't depend on the order of the seeds,
+                // so it can flood the ones it has and keep going.
+                floodLight(VOXEL_SUNLIGHT, world, heightmap, voxels, 0, queue);
+              }
+              pushQueue(queue, getVoxel(world, position[0], position[1], position[2]));
+            }
+          }
         }
       }
     }
   }
-  bounds[0] = 0.5f * (box[0] + box[3]);
-  bounds[1] = 0.5f * (box[1] + box[4]);
-  bounds[2] = 0.5f * (box[2] + box[5]);
-  const float halfWidth = 0.5f * (box[3] - box[0]),
-              halfHeight = 0.5f * (box[4] - box[1]),
-              halfDepth = 0.5f * (box[5] - box[2]);
-  bounds[3] = sqrt(
-    halfWidth * halfWidth
-    + halfHeight * halfHeight
-    + halfDepth * halfDepth
-  );
-  return faces;
+}
+#endif
+
+static void fillColumns(
+  const World* world,
+  Voxels* voxels,
+  const int fromX,
+  const int toX,
+  const int fromZ,
+  const int toZ
+) {
+  // Sunlight goes straight down at maxLight until it hits a block, so every
+  // air voxel above the first block of its column gets it without flooding.
+  // It runs a row at a time, with a flag per column of the row that is still
+  // open to the sky. It only writes the columns in [fromX, toX) x [fromZ, toZ).
+  const int width = toX - fromX;
+  unsigned char open[width];
+  for (int z = fromZ; z < toZ; z++) {
+    int count = width;
+    __builtin_memset(open, 1, width);
+    for (int y = world->height - 1; y >= 0 && count > 0; y--) {
+      int voxel = getVoxel(world, fromX, y, z);
+      for (int x = 0; x < width; voxel = getNextVoxel(world, voxel, fromX + x), x++) {
+        if (!open[x]) {
+          continue;
+        }
+        if (
+          getType(world, voxels, voxel) != TYPE_AIR
+          || !setLight(world, voxels, voxel, VOXEL_SUNLIGHT, maxLight)
+        ) {
+          open[x] = 0;
+          count--;
+        }
+      }
+    }
+  }
+}
+
+static void pushSpill(
+  const World* world,
+  const int* heightmap,
+  Voxels* voxels,
+  unsigned int* dirty,
+  Queue* queue,
+  const int fromX,
+  const int toX,
+  const int fromZ,
+  const int toZ
+) {
+  // Pushes the voxels of the lit columns in [fromX, toX) x [fromZ, toZ)
+  // (after fillColumns) where the sunlight spills sideways into the voxels
+  // under the neighboring heightmaps.
+  for (int z = fromZ; z < toZ; z++) {
+    for (int x = fromX; x < toX; x++) {
+      // The top of the lit column is the first block from the sky,
+      // which is at the heightmap unless the column is empty.
+      int top = heightmap[z * world->width + x];
+      while (top >= 0 && getType(world, voxels, getVoxel(world, x, top, z)) == TYPE_AIR) top--;
+      // Same rule as floodLight: a voxel at maxLight only spills
+      // sideways into the voxels under the neighbor's heightmap.
+      int reach = -1;
+      for (unsigned char n = 0; n < 4; n++) {
+        const int nx = x + neighbors[n * 3],
+                  nz = z + neighbors[n * 3 + 2];
+        if (
+          nx >= 0 && nx < world->width
+          && nz >= 0 && nz < world->depth
+          && reach < heightmap[nz * world->width + nx]
+        ) {
+          reach = heightmap[nz * world->width + nx];
+        }
+      }
+      if (reach >= world->height) reach = world->height - 1;
+      for (int y = top + 1; y <= reach; y++) {
+        const int voxel = getVoxel(world, x, y, z);
+        if (getLight(world, voxels, voxel, VOXEL_SUNLIGHT) != maxLight) {
+          continue;
+        }
+        if (queue->size >= queue->capacity / 2) {
+          // Flooding doesn't depend on the order of the seeds,
+          // so it can flood the ones it has and keep going.
+          floodLight(VOXEL_SUNLIGHT, world, heightmap, voxels, dirty, queue);
+        }
+        pushQueue(queue, voxel);
+      }
+    }
+  }
+}
+
+void propagateColumns(
+  const World* world,
+  Voxels* voxels,
+  const int fromZ,
+  const int toZ
+) {
+  // Fills the sunlit columns in [fromZ, toZ)
+  fillColumns(world, voxels, 0, world->width, fromZ, toZ);
+}
+
+void propagateSpill(
+  const World* world,
+  const int* heightmap,
+  Voxels* voxels,
+  Queue* queue,
+  const int fromX,
+  const int toX,
+  const int fromZ,
+  const int toZ
+) {
+  // Floods the sunlight that spills sideways from the columns in [fromX, toX) x [fromZ, toZ)
+  // (after propagateColumns) into the voxels under the neighboring heightmaps.
+  // It decays by 1 every voxel, so it never reaches further than maxLight - 1
+  // voxels from the tile and the tiles that are far enough apart can flood in parallel.
+  pushSpill(world, heightmap, voxels, 0, queue, fromX, toX, fromZ, toZ);
+  floodLight(
+    VOXEL_SUNLIGHT,
+    world,
+    heightmap,
+    voxels,
+    0,
+    queue
+  );
+}
+
+void propagate(
+  const World* world,
+  const int* heightmap,
+  Voxels* voxels,
+  Queue* queue
+) {
+  // Instead of flooding the whole sky from the top layer, it fills the sunlit
+  // columns in a linear pass and then only floods the sideways spill.
+  // The result is the same as flooding from the top layer.
+#if VOXELS_PALETTE
+  propagateSky(world, heightmap, voxels, queue);
+#endif
+  propagateColumns(world, voxels, 0, world->depth);
+  propagateSpill(world, heightmap, voxels, queue, 0, world->width, 0, world->depth);
+}
+
+// The simulation can skip runs of 8 voxels with no sand when the
+// storage can answer that cheaply: with SIMD on the dense layouts
+// or with the chunk palette types.
+#define SKIP_RUNS (VOXELS_PALETTE || VOXELS_SIMD)
+
+#if VOXELS_SIMD && !VOXELS_PALETTE
+#if VOXELS_PLANAR
+static const unsigned char typeMask[16] = {
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0, 0, 0, 0, 0, 0, 0, 0
+};
+#else
+static const unsigned char typeMask[48] = {
+  0xFF, 0, 0, 0, 0, 0, 0xFF, 0, 0, 0, 0, 0, 0xFF, 0, 0, 0,
+  0, 0, 0xFF, 0, 0, 0, 0, 0, 0xFF, 0, 0, 0, 0, 0, 0xFF, 0,
+  0, 0, 0, 0, 0xFF, 0, 0, 0, 0, 0, 0xFF, 0, 0, 0, 0, 0
+};
+#endif
+
+#endif
+
+#if SKIP_RUNS
+static const unsigned char hasType8(
+  const World* world,
+  const Voxels* voxels,
+  const int x,
+  const int y,
+  const int z,
+  const unsigned char type
+) {
+  // Tests if any of the 8 voxels from x to x + 7 can be of this type
+#if VOXELS_PALETTE
+  return (
+    hasPaletteType(voxels, getVoxel(world, x, y, z), type)
+    || hasPaletteType(voxels, getVoxel(world, x + 7, y, z), type)
+  );
+#else
+  if (x < world->width - world->offsetX && x + 7 >= world->width - world->offsetX) {
+    // The run wraps around in the storage (see World). Let the caller test it voxel by voxel.
+    return 1;
+  }
+  const unsigned char* run = &voxels[getVoxel(world, x, y, z)];
+  const simd_u8 value = simdU8Splat(type);
+  for (unsigned char i = 0; i < sizeof(typeMask); i += 16) {
+    const simd_u8 mask = simdU8Load(&typeMask[i]);
+    if (simdU8Any(simdU8And(
+      simdU8Eq(simdU8And(simdU8Load(&run[i]), mask), simdU8And(value, mask)),
+      mask
+    ))) {
+      return 1;
+    }
+  }
+  return 0;
+#endif
+}
+#endif
+
+static const int sandNeighbors[] = {
+  0, 0,
+  1, 0,
+  -1, 0,
+  0, 1,
+  0, -1
+};
+
+static inline const unsigned char isAwake(
+  const World* world,
+  const unsigned int* active,
+  const unsigned int* awake,
+  const int x,
+  const int y,
+  const int z
+) {
+  const int size = world->chunkSize,
+            chunk = ((z / size) * (world->height / size) + (y / size)) * (world->width / size) + (x / size);
+  return ((active[chunk >> 5] | awake[chunk >> 5]) >> (chunk & 31)) & 1;
+}
+
+static inline void wakeChunk(
+  const World* world,
+  unsigned int* awake,
+  const int x,
+  const int y,
+  const int z
+) {
+  if (awake == 0) {
+    return;
+  }
+  const int size = world->chunkSize,
+            chunk = ((z / size) * (world->height / size) + (y / size)) * (world->width / size) + (x / size);
+  awake[chunk >> 5] |= 1 << (chunk & 31);
+}
+
+static void relightMoves(
+  const World* world,
+  const int* heightmap,
+  Voxels* voxels,
+  unsigned int* dirty,
+  Queue* queueA,
+  Queue* queueB,
+  const int* moves,
+  const unsigned int count
+) {
+  // Same light passes as applyEdits, seeded from the voxels where
+  // the sand moved from or to. The ones that ended up holding sand
+  // get their light removed and the ones that ended up empty get
+  // reflooded from their neighbors.
+  for (unsigned char channel = VOXEL_LIGHT; channel <= VOXEL_SUNLIGHT; channel++) {
+    for (unsigned int i = 0; i < count; i++) {
+      const int voxel = moves[i];
+      if (getType(world, voxels, voxel) == TYPE_AIR) {
+        continue;
+      }
+      const unsigned char light = getLight(world, voxels, voxel, channel);
+      if (light != 0 && reserveQueue(queueA, 2) && setLight(world, voxels, voxel, channel, 0)) {
+        pushQueue(queueA, voxel);
+        pushQueue(queueA, light);
+      }
+    }
+    removeLight(
+      channel,
+      world,
+      voxels,
+      dirty,
+      queueA,
+      queueB
+    );
+    for (unsigned int i = 0; i < count; i++) {
+      const int voxel = moves[i];
+      if (getType(world, voxels, voxel) != TYPE_AIR) {
+        continue;
+      }
+      int position[3];
+      getPosition(world, voxel, position);
+      for (unsigned char n = 0; n < 6; n += 1) {
+        const int neighbor = getVoxel(
+          world,
+          position[0] + neighbors[n * 3],
+          position[1] + neighbors[n * 3 + 1],
+          position[2] + neighbors[n * 3 + 2]
+        );
+        if (neighbor != -1 && getLight(world, voxels, neighbor, channel) != 0) {
+          pushQueue(queueB, neighbor);
+        }
+      }
+    }
+    floodLight(
+      channel,
+      world,
+      heightmap,
+      voxels,
+      dirty,
+      queueB
+    );
+  }
+}
+
+void simulate(
+  const World* world,
+  int* heightmap,
+  Voxels* voxels,
+  unsigned int* dirty,
+  unsigned int* awake,
+  Queue* queueA,
+  Queue* queueB,
+  int* moves,
+  const unsigned int maxMoves,
+  const unsigned int step
+) {
+  // Keeps the heightmap updated as the sand moves and relights the
+  // voxels it moved from and to. The moves buffer collects those voxels
+  // and the light passes run once it gets full and at the end of the step,
+  // so the relighting cost scales with the amount of sand that moved.
+  // Only the chunks flagged in the awake bitset get swept. A chunk stays
+  // awake for the next step only if sand moved or got unsettled in it,
+  // so the cost scales with the moving sand instead of the world volume.
+  // Passing a null awake bitset sweeps the whole world.
+  const unsigned char invZ = (step % 4) < 2;
+  const unsigned char invX = (step % 2) == 0;
+  const int size = world->chunkSize;
+  const int words = awake != 0 ? (
+    ((world->width / size) * (world->height / size) * (world->depth / size) + 31) / 32
+  ) : 1;
+  // The chunks that were awake when the step started. The chunks woken
+  // during the step also get swept, since the sand above a move can
+  // get unsettled in a chunk that was asleep.
+  unsigned int active[words];
+  for (int i = 0; i < words; i++) {
+    active[i] = awake != 0 ? awake[i] : 0;
+    if (awake != 0) awake[i] = 0;
+  }
+  unsigned int count = 0;
+  for (int y = 1; y < world->height; y++) {
+    for (int sz = 2; sz < world->depth - 2; sz++) {
+      const int z = invZ ? world->depth - 1 - sz : sz;
+      for (int sx = 2; sx < world->width - 2; sx++) {
+        const int x = invX ? world->width - 1 - sx : sx;
+        if (
+          awake != 0
+          && (sx == 2 || x % size == (invX ? size - 1 : 0))
+          && !isAwake(world, active, awake, x, y, z)
+        ) {
+          // Skip to the first voxel of the next chunk in the sweep
+          sx += invX ? x % size : size - 1 - x % size;
+          continue;
+        }
+#if SKIP_RUNS
+        if (((sx - 2) & 7) == 0 && sx + 8 <= world->width - 2) {
+          // Skip the whole run if none of the next 8 voxels is sand.
+          // Moving sand only writes to the rows above and below,
+          // so testing the run right before sweeping it is safe.
+          if (!hasType8(world, voxels, invX ? x - 7 : x, y, z, TYPE_SAND)) {
+            sx += 7;
+            continue;
+          }
+        }
+#endif
+        const int voxel = getVoxel(world, x, y, z);
+        if (getType(world, voxels, voxel) != TYPE_SAND) {
+          continue;
+        }
+        int neighbor;
+        unsigned char n;
+        for (n = 0; n < 10; n += 2) {
+          neighbor = getVoxel(world, x + sandNeighbors[n], y - 1, z + sandNeighbors[n + 1]);
+          if (neighbor != -1 && getType(world, voxels, neighbor) == TYPE_AIR) {
+            break;
+          }
+        }
+        if (neighbor == -1 || getType(world, voxels, neighbor) != TYPE_AIR) {
+          setType(world, voxels, voxel, TYPE_STONE);
+          continue;
+        }
+        if (!setBlock(world, voxels, neighbor, TYPE_SAND, getColor(world, voxels, voxel))) {
+          continue;
+        }
+        setBlock(world, voxels, voxel, TYPE_AIR, 0);
+        const int nx = x + sandNeighbors[n],
+                  nz = z + sandNeighbors[n + 1];
+        if (heightmap[nz * world->width + nx] < y - 1) {
+          heightmap[nz * world->width + nx] = y - 1;
+        }
+        if (heightmap[z * world->width + x] == y) {
+          for (int h = y - 1; h >= 0; h--) {
+            if (h == 0 || getType(world, voxels, getVoxel(world, x, h, z)) != TYPE_AIR) {
+              heightmap[z * world->width + x] = h;
+              break;
+            }
+          }
+        }
+        if (count + 2 > maxMoves) {
+          relightMoves(world, heightmap, voxels, dirty, queueA, queueB, moves, count);
+          count = 0;
+        }
+        moves[count++] = voxel;
+        moves[count++] = neighbor;
+        // Sand <-> stone flips don't change the meshes,
+        // so only the moves mark the chunks as dirty.
+        markDirty(world, dirty, x, y, z);
+        markDirty(world, dirty, nx, y - 1, nz);
+        wakeChunk(world, awake, nx, y - 1, nz);
+        for (n = 0; n < 10; n += 2) {
+          neighbor = getVoxel(world, x + sandNeighbors[n], y + 1, z + sandNeighbors[n + 1]);
+          if (neighbor != -1 && getType(world, voxels, neighbor) == TYPE_STONE) {
+            setType(world, voxels, neighbor, TYPE_SAND);
+            wakeChunk(world, awake, x + sandNeighbors[n], y + 1, z + sandNeighbors[n + 1]);
+          }
+        }
+      }
+    }
+  }
+  relightMoves(world, heightmap, voxels, dirty, queueA, queueB, moves, count);
+}
+
+static const unsigned char isEditable(
+  const World* world,
+  const int x,
+  const int y,
+  const int z
+) {
+  return (
+    x >= 1 && x < world->width - 1
+    && y >= 0 && y < world->height - 1
+    && z >= 1 && z < world->depth - 1
+  );
+}
+
+static void applyEdits(
+  const World* world,
+  int* heightmap,
+  Voxels* voxels,
+  unsigned int* dirty,
+  Queue* queueA,
+  Queue* queueB,
+  const int* edits,
+  const unsigned int count
+) {
+  // Writes all the edits first and then runs a single light removal
+  // and a single flood per channel, seeded from the whole edit set.
+  // Edits are (x, y, z, type, r, g, b) tuples.
+  for (unsigned int i = 0; i < count; i++) {
+    const int* edit = &edits[i * 7];
+    const int x = edit[0],
+              y = edit[1],
+              z = edit[2];
+    const unsigned char type = edit[3];
+    if (!isEditable(world, x, y, z)) {
+      continue;
+    }
+    const int voxel = getVoxel(world, x, y, z);
+    const unsigned char current = getType(world, voxels, voxel);
+    if (!setBlock(
+      world,
+      voxels,
+      voxel,
+      type,
+      ((edit[4] & 0xFF) << 16) | ((edit[5] & 0xFF) << 8) | (edit[6] & 0xFF)
+    )) {
+      continue;
+    }
+    const int heightmapIndex = z * world->width + x;
+    const int height = heightmap[heightmapIndex];
+    if (type == TYPE_AIR) {
+      if (y == height) {
+        for (int h = y - 1; h >= 0; h --) {
+          if (h == 0 || getType(world, voxels, getVoxel(world, x, h, z)) != TYPE_AIR) {
+            heightmap[heightmapIndex] = h;
+            break;
+          }
+        }
+      }
+    } else if (height < y) {
+      heightmap[heightmapIndex] = y;
+    }
+    if (current == TYPE_LIGHT || (current == TYPE_AIR && type != TYPE_AIR)) {
+      const unsigned char light = getLight(world, voxels, voxel, VOXEL_LIGHT);
+      if (light != 0 && reserveQueue(queueA, 2) && setLight(world, voxels, voxel, VOXEL_LIGHT, 0)) {
+        pushQueue(queueA, voxel);
+        pushQueue(queueA, light);
+      }
+    }
+    markDirty(world, dirty, x, y, z);
+  }
+  for (unsigned char channel = VOXEL_LIGHT; channel <= VOXEL_SUNLIGHT; channel++) {
+    if (channel == VOXEL_SUNLIGHT) {
+      for (unsigned int i = 0; i < count; i++) {
+        const int* edit = &edits[i * 7];
+        if (!isEditable(world, edit[0], edit[1], edit[2])) {
+          continue;
+        }
+        const int voxel = getVoxel(world, edit[0], edit[1], edit[2]);
+        if (getType(world, voxels, voxel) == TYPE_AIR) {
+          continue;
+        }
+        const unsigned char light = getLight(world, voxels, voxel, VOXEL_SUNLIGHT);
+        if (light != 0 && reserveQueue(queueA, 2) && setLight(world, voxels, voxel, VOXEL_SUNLIGHT, 0)) {
+          pushQueue(queueA, voxel);
+          pushQueue(queueA, light);
+        }
+      }
+    }
+    removeLight(
+      channel,
+      world,
+      voxels,
+      dirty,
+      queueA,
+      queueB
+    );
+    for (unsigned int i = 0; i < count; i++) {
+      const int* edit = &edits[i * 7];
+      const int x = edit[0],
+                y = edit[1],
+                z = edit[2];
+      if (!isEditable(world, x, y, z)) {
+        continue;
+      }
+      const int voxel = getVoxel(world, x, y, z);
+      const unsigned char type = getType(world, voxels, voxel);
+      if (type == TYPE_LIGHT) {
+        if (channel == VOXEL_LIGHT && setLight(world, voxels, voxel, VOXEL_LIGHT, maxLight)) {
+          pushQueue(queueB, voxel);
+        }
+      } else if (type == TYPE_AIR) {
+        for (unsigned char n = 0; n < 6; n += 1) {
+          const int neighbor = getVoxel(
+            world,
+            x + neighbors[n * 3],
+            y + neighbors[n * 3 + 1],
+            z + neighbors[n * 3 + 2]
+          );
+          if (neighbor != -1 && getLight(world, voxels, neighbor, channel) != 0) {
+            pushQueue(queueB, neighbor);
+          }
+        }
+      }
+    }
+    floodLight(
+      channel,
+      world,
+      heightmap,
+      voxels,
+      dirty,
+      queueB
+    );
+  }
+}
+
+void update(
+  const World* world,
+  int* heightmap,
+  Voxels* voxels,
+  unsigned int* dirty,
+  Queue* queueA,
+  Queue* queueB,
+  const unsigned char type,
+  const int x,
+  const int y,
+  const int z,
+  const unsigned char r,
+  const unsigned char g,
+  const unsigned char b
+) {
+  const int edit[] = { x, y, z, type, r, g, b };
+  applyEdits(
+    world,
+    heightmap,
+    voxels,
+    dirty,
+    queueA,
+    queueB,
+    edit,
+    1
+  );
+}
+
+void updateBatch(
+  const World* world,
+  int* heightmap,
+  Voxels* voxels,
+  unsigned int* dirty,
+  Queue* queueA,
+  Queue* queueB,
+  const int* edits,
+  const unsigned int count
+) {
+  applyEdits(
+    world,
+    heightmap,
+    voxels,
+    dirty,
+    queueA,
+    queueB,
+    edits,
+    count
+  );
+}
+
+static const float getRandom(
+  unsigned int* seed
+) {
+  // xorshift32. Returns a float in [0, 1)
+  unsigned int x = *seed;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  *seed = x;
+  return (x >> 8) / 16777216.0f;
+}
+
+static const unsigned char getBrushChannel(
+  const unsigned char value,
+  const float noise,
+  unsigned int* seed
+) {
+  const float channel = value + (getRandom(seed) - 0.5f) * noise;
+  return channel < 0 ? 0 : (channel > 0xFF ? 0xFF : channel);
+}
+
+const int brush(
+  const World* world,
+  int* heightmap,
+  Voxels* voxels,
+  unsigned int* dirty,
+  Queue* queueA,
+  Queue* queueB,
+  int* edits,
+  const unsigned int maxEdits,
+  int* box,
+  const unsigned char shape,
+  const int size,
+  const int x,
+  const int y,
+  const int z,
+  const unsigned char type,
+  const unsigned char r,
+  const unsigned char g,
+  const unsigned char b,
+  const float noise,
+  const unsigned int seed
+) {
+  // Stamps a sphere or box brush centered at (x, y, z) with the same
+  // shapes as Controls.getBrush. Each channel of the color gets jittered
+  // by up to noise times the average of the three, using a PRNG seeded
+  // with seed. The edits buffer is used as scratch for batches of maxEdits
+  // and box gets the (from, to) chunk coordinates the brush touched,
+  // including the apron the mesher samples. The light changes can reach
+  // further than that, the dirty set tracks all of them.
+  // Returns the amount of voxels it stamped.
+  const int extent = shape == BRUSH_BOX ? size - 1 : size,
+            radius = size * size * 3;
+  const float amount = ((r + g + b) / 3.0f) * noise;
+  unsigned int state = seed != 0 ? seed : 1;
+  unsigned int count = 0;
+  int stamped = 0;
+  for (int bz = -extent; bz <= extent; bz++) {
+    for (int by = -extent; by <= extent; by++) {
+      for (int bx = -extent; bx <= extent; bx++) {
+        // Same as sqrt(x^2 + y^2 + z^2) <= sqrt((size * 0.5)^2 * 3)
+        if (shape == BRUSH_SPHERE && (bx * bx + by * by + bz * bz) * 4 > radius) {
+          continue;
+        }
+        if (count == maxEdits) {
+          applyEdits(world, heightmap, voxels, dirty, queueA, queueB, edits, count);
+          count = 0;
+        }
+        int* edit = &edits[count++ * 7];
+        edit[0] = x + bx;
+        edit[1] = y + by;
+        edit[2] = z + bz;
+        edit[3] = type;
+        edit[4] = getBrushChannel(r, amount, &state);
+        edit[5] = getBrushChannel(g, amount, &state);
+        edit[6] = getBrushChannel(b, amount, &state);
+        stamped++;
+      }
+    }
+  }
+  applyEdits(world, heightmap, voxels, dirty, queueA, queueB, edits, count);
+  const int chunkSize = world->chunkSize,
+            min[3] = { x - extent - 1, y - extent - 1, z - extent - 1 },
+            max[3] = { x + extent + 1, y + extent + 1, z + extent + 1 },
+            limits[3] = { world->width, world->height, world->depth };
+  for (unsigned char a = 0; a < 3; a++) {
+    box[a] = (min[a] < 0 ? 0 : min[a]) / chunkSize;
+    box[3 + a] = (max[a] >= limits[a] ? limits[a] - 1 : max[a]) / chunkSize;
+  }
+  return stamped;
+}
+
+static ChunkSummary* getMeshedSummary(
+  const World* world,
+  const unsigned char chunkSize,
+  const int chunkX,
+  const int chunkY,
+  const int chunkZ
+) {
+  // The summary only covers the world chunks,
+  // so any other chunk size or offset gets meshed the long way.
+  if (
+    world->summary == 0
+    || chunkSize != world->chunkSize
+    || chunkX % chunkSize != 0
+    || chunkY % chunkSize != 0
+    || chunkZ % chunkSize != 0
+  ) {
+    return 0;
+  }
+  return getSummary(world, chunkX / chunkSize, chunkY / chunkSize, chunkZ / chunkSize);
+}
+
+static const unsigned char getChunkOccupancy(
+  const World* world,
+  const unsigned char chunkSize,
+  const int chunkX,
+  const int chunkY,
+  const int chunkZ
+) {
+  if (getMeshedSummary(world, chunkSize, chunkX, chunkY, chunkZ) == 0) {
+    return CHUNK_MIXED;
+  }
+  return getOccupancy(world, chunkX / chunkSize, chunkY / chunkSize, chunkZ / chunkSize);
+}
+
+static __attribute__((noinline)) const unsigned int computeVisibility(
+  const World* world,
+  const Voxels* voxels,
+  const unsigned char chunkSize,
+  const int chunkX,
+  const int chunkY,
+  const int chunkZ
+) {
+  // Same as what mesh() stores, for the meshers that don't build the masks
+  const unsigned char occupancy = getChunkOccupancy(world, chunkSize, chunkX, chunkY, chunkZ);
+  if (occupancy == CHUNK_EMPTY) {
+    return VISIBILITY_ALL;
+  }
+  if (occupancy == CHUNK_SOLID || occupancy == CHUNK_ENCLOSED) {
+    return 0;
+  }
+  unsigned long long masks[(MAX_CHUNK_SIZE + 2) * (MAX_CHUNK_SIZE + 2)];
+  if (!buildMasks(world, voxels, masks, chunkSize, chunkX, chunkY, chunkZ)) {
+    return VISIBILITY_ALL;
+  }
+  return getVisibility(masks, chunkSize);
+}
+
+static const unsigned char isBuriedChunk(
+  const World* world,
+  const unsigned char chunkSize,
+  const int chunkX,
+  const int chunkY,
+  const int chunkZ
+) {
+  // The LOD cells take the majority of scale^3 voxels, so a neighbor only
+  // covers a solid chunk when it's entirely solid, not just its facing layer.
+  const unsigned char occupancy = getChunkOccupancy(world, chunkSize, chunkX, chunkY, chunkZ);
+  if (occupancy == CHUNK_EMPTY || occupancy == CHUNK_MIXED) {
+    return occupancy == CHUNK_EMPTY;
+  }
+  for (unsigned char n = 0; n < 6; n++) {
+    const ChunkSummary* neighbor = getSummary(
+      world,
+      chunkX / chunkSize + neighbors[n * 3],
+      chunkY / chunkSize + neighbors[n * 3 + 1],
+      chunkZ / chunkSize + neighbors[n * 3 + 2]
+    );
+    if (neighbor != 0 && neighbor->blocks != (unsigned int) chunkSize * chunkSize * chunkSize) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+const int mesh(
+  const World* world,
+  const Voxels* voxels,
+  float* bounds,
+  unsigned int* indices,
+  unsigned char* vertices,
+  unsigned char* colors,
+  const unsigned char chunkSize,
+  const int chunkX,
+  const int chunkY,
+  const int chunkZ,
+  const unsigned char flags
+) {
+  if (
+    chunkX < 0
+    || chunkY < 0
+    || chunkZ < 0
+    || chunkSize > MAX_CHUNK_SIZE
+    || chunkX + chunkSize > world->width
+    || chunkY + chunkSize > world->height
+    || chunkZ + chunkSize > world->depth
+  ) {
+    return -1;
+  }
+  if (!(flags & MESH_PACKED)) {
+    colors = 0;
+  }
+  if (flags & MESH_SHARED_INDICES) {
+    indices = 0;
+  }
+  unsigned char box[6] = { chunkSize, chunkSize, chunkSize, 0, 0, 0 };
+  ChunkSummary* summary = getMeshedSummary(world, chunkSize, chunkX, chunkY, chunkZ);
+  const unsigned char occupancy = getChunkOccupancy(world, chunkSize, chunkX, chunkY, chunkZ);
+  if (occupancy == CHUNK_EMPTY || occupancy == CHUNK_ENCLOSED) {
+    if (summary != 0) summary->visibility = occupancy == CHUNK_EMPTY ? VISIBILITY_ALL : 0;
+    getBounds(box, bounds);
+    return 0;
+  }
+  unsigned long long masks[(MAX_CHUNK_SIZE + 2) * (MAX_CHUNK_SIZE + 2)];
+  const unsigned char hasBlocks = buildMasks(world, voxels, masks, chunkSize, chunkX, chunkY, chunkZ);
+  if (summary != 0) {
+    summary->visibility = hasBlocks ? getVisibility(masks, chunkSize) : VISIBILITY_ALL;
+  }
+  if (!hasBlocks) {
+    getBounds(box, bounds);
+    return 0;
+  }
+  if (flags & MESH_GREEDY) {
+    return meshGreedy(
+      world,
+      voxels,
+      masks,
+      bounds,
+      indices,
+      vertices,
+      colors,
+      chunkSize,
+      chunkX,
+      chunkY,
+      chunkZ
+    );
+  }
+  unsigned int faces = 0;
+  for (int z = 1; z <= chunkSize; z++) {
+    for (int y = 1; y <= chunkSize; y++) {
+      for (unsigned char s = 0; s < 6; s++) {
+        unsigned long long exposed = getSideMask(masks, chunkSize, s, y, z);
+        while (exposed) {
+          const int x = __builtin_ctzll(exposed);
+          exposed &= exposed - 1;
+          const int position[3] = {
+            chunkX + x - 1,
+            chunkY + y - 1,
+            chunkZ + z - 1,
+          };
+          const unsigned int color = getColor(world, voxels, getVoxel(world, position[0], position[1], position[2]));
+          unsigned int light[4];
+          getSideLight(world, voxels, &sides[s], position, light);
+          pushSide(
+            box,
+            &faces,
+            indices,
+            vertices,
+            colors,
+            chunkX, chunkY, chunkZ,
+            &sides[s],
+            position,
+            1, 1,
+            (color >> 16) & 0xFF, (color >> 8) & 0xFF, color & 0xFF,
+            light
+          );
+        }
+      }
+    }
+  }
+  getBounds(box, bounds);
+  return faces;
+}
+
+#define MAX_LOD_CELLS (MAX_CHUNK_SIZE / 2 + 2)
+
+typedef struct {
+  unsigned char type;
+  unsigned char r, g, b;
+  unsigned char light;
+  unsigned char sunlight;
+} LODCell;
+
+static void downsampleCell(
+  const World* world,
+  const Voxels* voxels,
+  LODCell* cell,
+  const int cellX,
+  const int cellY,
+  const int cellZ,
+  const unsigned char scale
+) {
+  // The cell takes the majority type (solid wins the ties with air), the average
+  // color of the voxels of that type and the average light of the air voxels.
+  // Cells out of the world are solid, since faces facing out of it don't get meshed.
+  if (getVoxel(world, cellX, cellY, cellZ) == -1) {
+    cell->type = TYPE_STONE;
+    return;
+  }
+  unsigned int counts[4] = { 0 },
+               color[4][3] = { { 0 } },
+               light = 0,
+               sunlight = 0;
+  for (int z = cellZ; z < cellZ + scale; z++) {
+    for (int y = cellY; y < cellY + scale; y++) {
+      int voxel = getVoxel(world, cellX, y, z);
+      for (int x = 0; x < scale; voxel = getNextVoxel(world, voxel, cellX + x), x++) {
+        const unsigned char type = getType(world, voxels, voxel);
+        counts[type]++;
+        if (type == TYPE_AIR) {
+          light += getLight(world, voxels, voxel, VOXEL_LIGHT);
+          sunlight += getLight(world, voxels, voxel, VOXEL_SUNLIGHT);
+        } else {
+          const unsigned int rgb = getColor(world, voxels, voxel);
+          color[type][0] += (rgb >> 16) & 0xFF;
+          color[type][1] += (rgb >> 8) & 0xFF;
+          color[type][2] += rgb & 0xFF;
+        }
+      }
+    }
+  }
+  unsigned char type = TYPE_AIR;
+  for (unsigned char t = TYPE_AIR + 1; t < 4; t++) {
+    if (counts[t] > counts[type] || (type == TYPE_AIR && counts[t] > 0 && counts[t] == counts[type])) {
+      type = t;
+    }
+  }
+  cell->type = type;
+  if (type == TYPE_AIR) {
+    cell->light = light / counts[TYPE_AIR];
+    cell->sunlight = sunlight / counts[TYPE_AIR];
+  } else {
+    cell->r = color[type][0] / counts[type];
+    cell->g = color[type][1] / counts[type];
+    cell->b = color[type][2] / counts[type];
+  }
+}
+
+static __attribute__((noinline)) const int meshCells(
+  const World* world,
+  const Voxels* voxels,
+  float* bounds,
+  unsigned int* indices,
+  unsigned char* vertices,
+  unsigned char* colors,
+  const unsigned char chunkSize,
+  const int chunkX,
+  const int chunkY,
+  const int chunkZ,
+  const unsigned char scale,
+  const unsigned char flags
+) {
+  if (
+    chunkX < 0
+    || chunkY < 0
+    || chunkZ < 0
+    || chunkSize > MAX_CHUNK_SIZE
+    || chunkX + chunkSize > world->width
+    || chunkY + chunkSize > world->height
+    || chunkZ + chunkSize > world->depth
+    || scale < 2
+    || (scale & (scale - 1)) != 0
+    || chunkSize % scale != 0
+  ) {
+    return -1;
+  }
+  if (!(flags & MESH_PACKED)) {
+    colors = 0;
+  }
+  if (flags & MESH_SHARED_INDICES) {
+    indices = 0;
+  }
+  unsigned char box[6] = { chunkSize, chunkSize, chunkSize, 0, 0, 0 };
+  if (isBuriedChunk(world, chunkSize, chunkX, chunkY, chunkZ)) {
+    getBounds(box, bounds);
+    return 0;
+  }
+  // The cells of the chunk plus a 1 cell apron
+  const int size = chunkSize / scale,
+            stride = size + 2;
+  LODCell cells[MAX_LOD_CELLS * MAX_LOD_CELLS * MAX_LOD_CELLS];
+  for (int z = 0, c = 0; z < stride; z++) {
+    for (int y = 0; y < stride; y++) {
+      for (int x = 0; x < stride; x++, c++) {
+        // The faces only test the 6 neighbors,
+        // so the edges and corners of the apron are never read.
+        if (
+          (x == 0 || x == stride - 1)
+          + (y == 0 || y == stride - 1)
+          + (z == 0 || z == stride - 1)
+          > 1
+        ) {
+          continue;
+        }
+        downsampleCell(
+          world,
+          voxels,
+          &cells[c],
+          chunkX + (x - 1) * scale,
+          chunkY + (y - 1) * scale,
+          chunkZ + (z - 1) * scale,
+          scale
+        );
+      }
+    }
+  }
+  unsigned int faces = 0;
+  for (int z = 1; z <= size; z++) {
+    for (int y = 1; y <= size; y++) {
+      for (int x = 1; x <= size; x++) {
+        const LODCell* cell = &cells[(z * stride + y) * stride + x];
+        if (cell->type == TYPE_AIR) {
+          continue;
+        }
+        for (unsigned char s = 0; s < 6; s++) {
+          const Side* side = &sides[s];
+          int n[3] = { x, y, z };
+          n[side->axis] += side->direction;
+          const LODCell* neighbor = &cells[(n[2] * stride + n[1]) * stride + n[0]];
+          if (neighbor->type != TYPE_AIR) {
+            continue;
+          }
+          int position[3] = {
+            chunkX + (x - 1) * scale,
+            chunkY + (y - 1) * scale,
+            chunkZ + (z - 1) * scale,
+          };
+          // pushSide moves the positive faces by 1 voxel
+          if (side->direction > 0) position[side->axis] += scale - 1;
+          const unsigned int l = (
+            ((neighbor->light * 0xFF / maxLight) << 8)
+            | (neighbor->sunlight * 0xFF / maxLight)
+          );
+          const unsigned int light[4] = { l, l, l, l };
+          pushSide(
+            box,
+            &faces,
+            indices,
+            vertices,
+            colors,
+            chunkX, chunkY, chunkZ,
+            side,
+            position,
+            scale, scale,
+            cell->r, cell->g, cell->b,
+            light
+          );
+        }
+      }
+    }
+  }
+  getBounds(box, bounds);
+  return faces;
+}
+
+const int meshLOD(
+  const World* world,
+  const Voxels* voxels,
+  float* bounds,
+  unsigned int* indices,
+  unsigned char* vertices,
+  unsigned char* colors,
+  const unsigned char chunkSize,
+  const int chunkX,
+  const int chunkY,
+  const int chunkZ,
+  const unsigned char scale,
+  const unsigned char flags
+) {
+  // Meshes the chunk downsampled into cells of scale^3 voxels (2, 4 or 8).
+  // The faces are flat shaded with the light of the cell they face,
+  // and the output is in the same format as mesh() with the same flags.
+  // The visibility always comes from the full resolution voxels. It gets
+  // computed before meshing the cells and neither of them get inlined,
+  // so their stack frames don't pile up on the 64KB worker stacks.
+  ChunkSummary* summary = getMeshedSummary(world, chunkSize, chunkX, chunkY, chunkZ);
+  if (summary != 0) {
+    summary->visibility = computeVisibility(world, voxels, chunkSize, chunkX, chunkY, chunkZ);
+  }
+  return meshCells(
+    world,
+    voxels,
+    bounds,
+    indices,
+    vertices,
+    colors,
+    chunkSize,
+    chunkX,
+    chunkY,
+    chunkZ,
+    scale,
+    flags
+  );
+}
+
+const float raycast(
+  const World* world,
+  const Voxels* voxels,
+  int* hit,
+  const float originX,
+  const float originY,
+  const float originZ,
+  const float directionX,
+  const float directionY,
+  const float directionZ,
+  const float maxDistance
+) {
+  // Walks the voxels along the ray (Amanatides & Woo) until it finds a block.
+  // Writes the hit voxel position and the normal of the face the ray
+  // entered it through into hit and returns the distance to it,
+  // or -1 when there's no block within maxDistance.
+  // The direction must be normalized for the distance to be in voxels.
+  const float origin[3] = { originX, originY, originZ },
+              direction[3] = { directionX, directionY, directionZ };
+  const int size[3] = { world->width, world->height, world->depth };
+  // Clip the ray to the world bounds
+  float distance = 0, exit = maxDistance;
+  int axis = -1;
+  for (unsigned char a = 0; a < 3; a++) {
+    if (direction[a] == 0) {
+      if (origin[a] < 0 || origin[a] >= size[a]) {
+        return -1;
+      }
+      continue;
+    }
+    const float t1 = -origin[a] / direction[a],
+                t2 = (size[a] - origin[a]) / direction[a],
+                near = t1 < t2 ? t1 : t2,
+                far = t1 < t2 ? t2 : t1;
+    if (near > distance) {
+      distance = near;
+      axis = a;
+    }
+    if (far < exit) exit = far;
+  }
+  if (distance > exit) {
+    return -1;
+  }
+  int voxel[3], step[3];
+  float next[3], delta[3];
+  for (unsigned char a = 0; a < 3; a++) {
+    voxel[a] = floor(origin[a] + direction[a] * distance);
+    if (voxel[a] < 0) voxel[a] = 0;
+    if (voxel[a] >= size[a]) voxel[a] = size[a] - 1;
+    step[a] = direction[a] > 0 ? 1 : (direction[a] < 0 ? -1 : 0);
+    if (step[a] == 0) {
+      next[a] = delta[a] = __builtin_inff();
+      continue;
+    }
+    next[a] = (voxel[a] + (step[a] > 0 ? 1 : 0) - origin[a]) / direction[a];
+    delta[a] = step[a] / direction[a];
+  }
+  while (1) {
+    if (getType(world, voxels, getVoxel(world, voxel[0], voxel[1], voxel[2])) != TYPE_AIR) {
+      for (unsigned char a = 0; a < 3; a++) {
+        hit[a] = voxel[a];
+        hit[3 + a] = a == axis ? -step[a] : 0;
+      }
+      return distance;
+    }
+    axis = next[0] < next[1] ? (next[0] < next[2] ? 0 : 2) : (next[1] < next[2] ? 1 : 2);
+    distance = next[axis];
+    voxel[axis] += step[axis];
+    next[axis] += delta[axis];
+    if (distance > exit || voxel[axis] < 0 || voxel[axis] >= size[axis]) {
+      return -1;
+    }
+  }
+}
+
+void exportVoxels(
+  const World* world,
+  const Voxels* voxels,
+  const int z,
+  unsigned char* output
+) {
+  // Writes the z slice of the world as interleaved
+  // (type, r, g, b, light, sunlight) voxels, like the .blocks files.
+  for (int y = 0, i = 0; y < world->height; y++) {
+    for (int x = 0; x < world->width; x++, i += VOXELS_STRIDE) {
+      const int voxel = getVoxel(world, x, y, z);
+      const unsigned int color = getColor(world, voxels, voxel);
+      output[i + VOXEL_TYPE] = getType(world, voxels, voxel);
+      output[i + VOXEL_R] = (color >> 16) & 0xFF;
+      output[i + VOXEL_G] = (color >> 8) & 0xFF;
+      output[i + VOXEL_B] = color & 0xFF;
+      output[i + VOXEL_LIGHT] = getLight(world, voxels, voxel, VOXEL_LIGHT);
+      output[i + VOXEL_SUNLIGHT] = getLight(world, voxels, voxel, VOXEL_SUNLIGHT);
+    }
+  }
+}
+
+void importVoxels(
+  const World* world,
+  Voxels* voxels,
+  const int z,
+  const unsigned char* input
+) {
+  // Inverse of exportVoxels
+  for (int y = 0, i = 0; y < world->height; y++) {
+    for (int x = 0; x < world->width; x++, i += VOXELS_STRIDE) {
+      const int voxel = getVoxel(world, x, y, z);
+      setBlock(
+        world,
+        voxels,
+        voxel,
+        input[i + VOXEL_TYPE],
+        (input[i + VOXEL_R] << 16) | (input[i + VOXEL_G] << 8) | input[i + VOXEL_B]
+      );
+      setLight(world, voxels, voxel, VOXEL_LIGHT, input[i + VOXEL_LIGHT]);
+      setLight(world, voxels, voxel, VOXEL_SUNLIGHT, input[i + VOXEL_SUNLIGHT]);
+    }
+  }
+}
+
+const int exportChunk(
+  const World* world,
+  const Voxels* voxels,
+  const int chunkX,
+  const int chunkY,
+  const int chunkZ,
+  unsigned char* output
+) {
+  // Writes the chunk at (chunkX, chunkY, chunkZ) as (type, r, g, b) voxels
+  // in z, y, x order, like the chunks of the v2 .blocks files.
+  // Returns the amount of blocks in it, so all-air chunks can be skipped.
+  const int size = world->chunkSize;
+  int blocks = 0;
+  for (int z = chunkZ, i = 0; z < chunkZ + size; z++) {
+    for (int y = chunkY; y < chunkY + size; y++) {
+      for (int x = chunkX; x < chunkX + size; x++, i += 4) {
+        const int voxel = getVoxel(world, x, y, z);
+        const unsigned char type = getType(world, voxels, voxel);
+        const unsigned int color = type != TYPE_AIR ? getColor(world, voxels, voxel) : 0;
+        output[i] = type;
+        output[i + 1] = (color >> 16) & 0xFF;
+        output[i + 2] = (color >> 8) & 0xFF;
+        output[i + 3] = color & 0xFF;
+        if (type != TYPE_AIR) blocks++;
+      }
+    }
+  }
+  return blocks;
+}
+
+void importChunk(
+  const World* world,
+  int* heightmap,
+  Voxels* voxels,
+  const int chunkX,
+  const int chunkY,
+  const int chunkZ,
+  const unsigned char* input
+) {
+  // Inverse of exportChunk. It expects a cleared world, so it only raises
+  // the heightmap and leaves the light for relightRegion to compute once
+  // the chunks around are in too (see VoxelWorld.importChunks).
+  const int size = world->chunkSize;
+  for (int z = chunkZ, i = 0; z < chunkZ + size; z++) {
+    for (int y = chunkY; y < chunkY + size; y++) {
+      for (int x = chunkX; x < chunkX + size; x++, i += 4) {
+        if (input[i] == TYPE_AIR) {
+          continue;
+        }
+        setBlock(
+          world,
+          voxels,
+          getVoxel(world, x, y, z),
+          input[i],
+          (input[i + 1] << 16) | (input[i + 2] << 8) | input[i + 3]
+        );
+        if (heightmap[z * world->width + x] < y) {
+          heightmap[z * world->width + x] = y;
+        }
+      }
+    }
+  }
+}
+
+void relight(
+  const World* world,
+  const int* heightmap,
+  Voxels* voxels,
+  Queue* queue
+) {
+  // Computes the light of a world with no light in it:
+  // The sunlight with propagate and then the light of every emitter.
+  propagate(world, heightmap, voxels, queue);
+  for (int z = 0; z < world->depth; z++) {
+    for (int y = 0; y < world->height; y++) {
+      int voxel = getVoxel(world, 0, y, z);
+      for (int x = 0; x < world->width; voxel = getNextVoxel(world, voxel, x), x++) {
+        if (
+          getType(world, voxels, voxel) != TYPE_LIGHT
+          || !setLight(world, voxels, voxel, VOXEL_LIGHT, maxLight)
+        ) {
+          continue;
+        }
+        if (queue->size >= queue->capacity / 2) {
+          // Same as propagateSky, flood the seeds it has and keep going.
+          floodLight(VOXEL_LIGHT, world, heightmap, voxels, 0, queue);
+        }
+        pushQueue(queue, voxel);
+      }
+    }
+  }
+  floodLight(VOXEL_LIGHT, world, heightmap, voxels, 0, queue);
+}
+
+void rebuildHeightmap(
+  const World* world,
+  int* heightmap,
+  Voxels* voxels,
+  Queue* queue,
+  const unsigned char recomputeLight
+) {
+  // Rebuilds the heightmap after importing the voxels.
+  // It sweeps each z slice from the top down with x in the inner loop,
+  // which is the order the voxels are laid out in memory, and moves on
+  // to the next slice as soon as every column in it has found its top.
+  // With recomputeLight it also throws away the imported light
+  // and computes it again with relight.
+  for (int z = 0; z < world->depth; z++) {
+    int* row = &heightmap[z * world->width];
+    int remaining = world->width;
+    for (int x = 0; x < world->width; x++) {
+      row[x] = -1;
+    }
+    for (int y = world->height - 1; y > 0 && remaining > 0; y--) {
+      int voxel = getVoxel(world, 0, y, z);
+      for (int x = 0; x < world->width; voxel = getNextVoxel(world, voxel, x), x++) {
+        if (row[x] == -1 && getType(world, voxels, voxel) != TYPE_AIR) {
+          row[x] = y;
+          remaining--;
+        }
+      }
+    }
+    for (int x = 0; x < world->width; x++) {
+      if (row[x] == -1) row[x] = 0;
+    }
+  }
+  if (!recomputeLight) {
+    return;
+  }
+  for (int z = 0; z < world->depth; z++) {
+    for (int y = 0; y < world->height; y++) {
+      int voxel = getVoxel(world, 0, y, z);
+      for (int x = 0; x < world->width; voxel = getNextVoxel(world, voxel, x), x++) {
+        setLight(world, voxels, voxel, VOXEL_LIGHT, 0);
+        setLight(world, voxels, voxel, VOXEL_SUNLIGHT, 0);
+      }
+    }
+  }
+  relight(world, heightmap, voxels, queue);
+}
+
+static void shiftGrid(
+  unsigned char* data,
+  const int element,
+  const int width,
+  const int height,
+  const int depth,
+  const int dx,
+  const int dz
+) {
+  // Moves a [depth][height][width] grid of elements by (-dx, -dz)
+  // and zeroes the elements it uncovers. It walks the rows in the
+  // direction that never overwrites a row before it has been moved.
+  const int row = width * element,
+            step = dz > 0 ? 1 : -1;
+  for (int i = 0, z = dz > 0 ? 0 : depth - 1; i < depth; i++, z += step) {
+    for (int y = 0; y < height; y++) {
+      unsigned char* target = data + (z * height + y) * row;
+      const int sz = z + dz;
+      if (sz < 0 || sz >= depth || dx >= width || -dx >= width) {
+        __builtin_memset(target, 0, row);
+        continue;
+      }
+      const unsigned char* source = data + (sz * height + y) * row;
+      if (dx >= 0) {
+        __builtin_memmove(target, source + dx * element, (width - dx) * element);
+        __builtin_memset(target + (width - dx) * element, 0, dx * element);
+      } else {
+        __builtin_memmove(target - dx * element, source, (width + dx) * element);
+        __builtin_memset(target, 0, -dx * element);
+      }
+    }
+  }
+}
+
+#if !VOXELS_PALETTE
+static void clearColumns(
+  const World* world,
+  Voxels* voxels,
+  const int fromX,
+  const int toX,
+  const int fromZ,
+  const int toZ
+) {
+  // Zeroes the voxels of the columns from (fromX, fromZ) to (toX, toZ).
+  // The rows can wrap around in the storage, so each one goes in up to two runs.
+  const int planes = VOXELS_PLANAR ? VOXELS_STRIDE : 1,
+            plane = world->width * world->height * world->depth,
+            wrap = world->width - world->offsetX;
+  for (int z = fromZ; z < toZ; z++) {
+    for (int y = 0; y < world->height; y++) {
+      for (int x = fromX; x < toX;) {
+        const int end = x < wrap && toX > wrap ? wrap : toX,
+                  voxel = getVoxel(world, x, y, z);
+        for (int i = 0; i < planes; i++) {
+          __builtin_memset(voxels + i * plane + voxel, 0, (end - x) * VOXELS_STEP);
+        }
+        x = end;
+      }
+    }
+  }
+}
+#endif
+
+void shiftVoxels(
+  World* world,
+  int* heightmap,
+  Voxels* voxels,
+  const int dx,
+  const int dz
+) {
+  // Moves the voxels and the heightmap so the voxel at (x, y, z) ends up
+  // at (x - dx, y, z - dz). The ones that fall off the world get dropped
+  // and the columns it uncovers are left as dark air with a zero heightmap.
+  // The world streaming uses it to slide the world under the camera,
+  // dx and dz must be multiples of the chunk size and smaller than the world.
+#if VOXELS_PALETTE
+  const int chunksX = world->width >> PALETTE_CHUNK_BITS,
+            chunksY = world->height >> PALETTE_CHUNK_BITS,
+            chunksZ = world->depth >> PALETTE_CHUNK_BITS,
+            cdx = dx / PALETTE_CHUNK_SIZE,
+            cdz = dz / PALETTE_CHUNK_SIZE;
+  // Only the chunk headers move. The ones that fall off give back their blocks.
+  for (int cz = 0, chunk = 0; cz < chunksZ; cz++) {
+    for (int cy = 0; cy < chunksY; cy++) {
+      for (int cx = 0; cx < chunksX; cx++, chunk++) {
+        if (cx - cdx >= 0 && cx - cdx < chunksX && cz - cdz >= 0 && cz - cdz < chunksZ) {
+          continue;
+        }
+        PaletteChunk* header = &voxels->chunks[chunk];
+        if (header->bits != 0) {
+          releasePalette(voxels, header);
+        }
+        if (header->light != 0) {
+          freePool(voxels, header->light, PALETTE_CHUNK_VOXELS * 2);
+          header->light = 0;
+        }
+      }
+    }
+  }
+  shiftGrid((unsigned char*) voxels->chunks, sizeof(PaletteChunk), chunksX, chunksY, chunksZ, cdx, cdz);
+#else
+  // None of the voxels move. It moves where the storage starts instead (see World),
+  // which wraps the ones that fell off around to the columns it uncovers.
+  world->offsetX = (world->offsetX + dx + world->width) % world->width;
+  world->offsetZ = (world->offsetZ + dz + world->depth) % world->depth;
+  const int fromX = dx > 0 ? world->width - dx : 0,
+            toX = dx > 0 ? world->width : -dx,
+            fromZ = dz > 0 ? world->depth - dz : 0,
+            toZ = dz > 0 ? world->depth : -dz;
+  clearColumns(world, voxels, fromX, toX, 0, world->depth);
+  if (dx > 0) {
+    clearColumns(world, voxels, 0, fromX, fromZ, toZ);
+  } else {
+    clearColumns(world, voxels, toX, world->width, fromZ, toZ);
+  }
+#endif
+  shiftGrid((unsigned char*) heightmap, sizeof(int), world->width, 1, world->depth, dx, dz);
+  if (world->summary != 0) {
+    // The uncovered chunks are all air, which is a zeroed summary
+    shiftGrid(
+      (unsigned char*) world->summary,
+      sizeof(ChunkSummary),
+      world->width / world->chunkSize,
+      world->height / world->chunkSize,
+      world->depth / world->chunkSize,
+      dx / world->chunkSize,
+      dz / world->chunkSize
+    );
+  }
+}
+
+static void pushBorder(
+  const unsigned char channel,
+  const World* world,
+  const int* heightmap,
+  Voxels* voxels,
+  unsigned int* dirty,
+  Queue* queue,
+  const int fromX,
+  const int toX,
+  const int z
+) {
+  // Pushes the voxels of the [fromX, toX) columns at z that can light their neighbors
+  if (z < 0 || z >= world->depth) {
+    return;
+  }
+  for (int y = 0; y < world->height; y++) {
+    for (int x = fromX > 0 ? fromX : 0; x < toX && x < world->width; x++) {
+      const int voxel = getVoxel(world, x, y, z);
+      if (getLight(world, voxels, voxel, channel) <= 1) {
+        continue;
+      }
+      if (queue->size >= queue->capacity / 2) {
+        floodLight(channel, world, heightmap, voxels, dirty, queue);
+      }
+      pushQueue(queue, voxel);
+    }
+  }
+}
+
+static void clearLight(
+  const World* world,
+  const int* heightmap,
+  Voxels* voxels,
+  const int fromX,
+  const int toX,
+  const int fromZ,
+  const int toZ
+) {
+  // Zeroes the light of the columns in [fromX, toX) x [fromZ, toZ)
+#if VOXELS_PALETTE
+  // When the region is made of whole chunks, they drop their light planes
+  // instead of allocating one to hold the zeros, and the ones above the
+  // heightmap get their sunlight straight away, same as in propagateSky.
+  if (((fromX | toX | fromZ | toZ) & (PALETTE_CHUNK_SIZE - 1)) == 0) {
+    const int size = PALETTE_CHUNK_SIZE,
+              chunksX = world->width / size,
+              chunksY = world->height / size;
+    for (int cz = fromZ / size; cz < toZ / size; cz++) {
+      for (int cx = fromX / size; cx < toX / size; cx++) {
+        int top = -1;
+        for (int z = cz * size; z < (cz + 1) * size; z++) {
+          for (int x = cx * size; x < (cx + 1) * size; x++) {
+            if (top < heightmap[z * world->width + x]) top = heightmap[z * world->width + x];
+          }
+        }
+        unsigned char isSky = 1;
+        for (int cy = chunksY - 1; cy >= 0; cy--) {
+          PaletteChunk* chunk = &voxels->chunks[(cz * chunksY + cy) * chunksX + cx];
+          if (chunk->light != 0) {
+            freePool(voxels, chunk->light, PALETTE_CHUNK_VOXELS * 2);
+            chunk->light = 0;
+          }
+          isSky = isSky && chunk->bits == 0 && cy * size > top;
+          chunk->uniformLight = isSky ? maxLight << 8 : 0;
+        }
+      }
+    }
+    return;
+  }
+#endif
+  for (int z = fromZ; z < toZ; z++) {
+    for (int y = 0; y < world->height; y++) {
+      int voxel = getVoxel(world, fromX, y, z);
+      for (int x = fromX; x < toX; voxel = getNextVoxel(world, voxel, x), x++) {
+        setLight(world, voxels, voxel, VOXEL_LIGHT, 0);
+        setLight(world, voxels, voxel, VOXEL_SUNLIGHT, 0);
+      }
+    }
+  }
+}
+
+void clearRegion(
+  const World* world,
+  const int* heightmap,
+  Voxels* voxels,
+  const int fromX,
+  const int toX,
+  const int fromZ,
+  const int toZ
+) {
+  // Zeroes the light of the columns in [fromX, toX) x [fromZ, toZ) without
+  // flagging them, so the world streaming can relight them a piece at a time
+  // with relightRegion. Clearing all of them first keeps the stale light of the
+  // dropped columns from leaking into the pieces, which pull it from their neighbors.
+  clearLight(world, heightmap, voxels, fromX, toX, fromZ, toZ);
+}
+
+void relightRegion(
+  const World* world,
+  const int* heightmap,
+  Voxels* voxels,
+  unsigned int* dirty,
+  Queue* queue,
+  const int fromX,
+  const int toX,
+  const int fromZ,
+  const int toZ
+) {
+  // Recomputes the light of the columns in [fromX, toX) x [fromZ, toZ) from
+  // scratch: Their sunlit columns and emitters plus the light that comes in
+  // from the columns around them. The world streaming runs it on the columns
+  // it brings in and on the ones next to the columns it drops, since the light
+  // that came from those doesn't reach further than maxLight - 1 voxels in.
+  // It flags the chunks around the region as dirty.
+  const int size = world->chunkSize,
+            chunksX = world->width / size,
+            chunksY = world->height / size,
+            chunksZ = world->depth / size;
+  clearLight(world, heightmap, voxels, fromX, toX, fromZ, toZ);
+  for (int cz = fromZ > 0 ? (fromZ - 1) / size : 0; cz <= toZ / size && cz < chunksZ; cz++) {
+    for (int cy = 0; cy < chunksY; cy++) {
+      for (int cx = fromX > 0 ? (fromX - 1) / size : 0; cx <= toX / size && cx < chunksX; cx++) {
+        const int chunk = cz * chunksX * chunksY + cy * chunksX + cx;
+        dirty[chunk >> 5] |= 1 << (chunk & 31);
+      }
+    }
+  }
+  fillColumns(world, voxels, fromX, toX, fromZ, toZ);
+  for (int z = fromZ; z < toZ; z++) {
+    for (int y = 0; y < world->height; y++) {
+      int voxel = getVoxel(world, fromX, y, z);
+      for (int x = fromX; x < toX; voxel = getNextVoxel(world, voxel, x), x++) {
+        if (getType(world, voxels, voxel) == TYPE_LIGHT) {
+          setLight(world, voxels, voxel, VOXEL_LIGHT, maxLight);
+        }
+      }
+    }
+  }
+  // The sunlight floods first, since the emitters go into the same queue
+  pushSpill(world, heightmap, voxels, dirty, queue, fromX, toX, fromZ, toZ);
+  for (unsigned char channel = VOXEL_SUNLIGHT; channel >= VOXEL_LIGHT; channel--) {
+    if (channel == VOXEL_LIGHT) {
+      for (int z = fromZ; z < toZ; z++) {
+        pushBorder(channel, world, heightmap, voxels, dirty, queue, fromX, toX, z);
+      }
+    }
+    for (int z = fromZ; z < toZ; z++) {
+      pushBorder(channel, world, heightmap, voxels, dirty, queue, fromX - 1, fromX, z);
+      pushBorder(channel, world, heightmap, voxels, dirty, queue, toX, toX + 1, z);
+    }
+    pushBorder(channel, world, heightmap, voxels, dirty, queue, fromX, toX, fromZ - 1);
+    pushBorder(channel, world, heightmap, voxels, dirty, queue, fromX, toX, toZ);
+    floodLight(channel, world, heightmap, voxels, dirty, queue);
+  }
+}
+
+const int getLayout() {
+  // 0: Interleaved fields, 1: One plane per field, 2: Palette compressed chunks.
+  // The JS side needs to know it to reserve the memory for the voxels.
+  return VOXELS_PALETTE ? 2 : VOXELS_PLANAR;
 }
@@ -1,47 +1,180 @@
 class VoxelWorld {
   constructor({
     wasm,
+    workers = VoxelWorld.defaultWorkers(),
     chunkSize = 32,
+    greedyMeshing = false,
+    packedVertices = false,
+    sharedIndices = false,
     width,
     height,
     depth,
+    queueSize = width * depth * 2,
+    maxEdits = 4096,
+    lodDistances = [96, 160, 224],
+    palette = false,
+    paletteMemory = width * height * depth * 2,
+    streaming = false,
     onLoad,
   }) {
     this.chunkSize = chunkSize;
+    this.meshFlags = (
+      (greedyMeshing ? VoxelWorld.meshFlags.greedy : 0)
+      | (packedVertices ? VoxelWorld.meshFlags.packed : 0)
+      | (sharedIndices ? VoxelWorld.meshFlags.sharedIndices : 0)
+    );
     this.width = width;
     this.height = height;
     this.depth = depth;
     this.simulationStep = 0;
+    this.chunks = {
+      x: width / chunkSize,
+      y: height / chunkSize,
+      z: depth / chunkSize,
+    };
+    this.maxEdits = maxEdits;
+    this.lodDistances = lodDistances;
+    // World voxel of the first voxel of the memory. It only moves with the streaming option.
+    this.origin = { x: 0, z: 0 };
+    if (streaming) {
+      // The edited columns that left the world, by "x,z" world chunk (see stream).
+      // The chunk columns still waiting for their light (see relightStreamed).
+      this.streaming = {
+        cache: new Map(),
+        edited: new Uint8Array(this.chunks.x * this.chunks.z),
+        relight: [],
+      };
+    }
+    // The state of the .blocks file being imported (see importChunks)
+    this.importing = null;
+    // The compressed chunks of the last saved or loaded .blocks file
+    // and the chunks modified since, so saving only has to compress those.
+    this.savedChunks = [];
+    this.unsaved = new Uint32Array(Math.ceil((this.chunks.x * this.chunks.y * this.chunks.z) / 32));
+    this.unsaved.fill(0xFFFFFFFF);
     const maxFaces = Math.ceil(chunkSize * chunkSize * chunkSize * 0.5) * 6; // worst possible case
-    const queueSize = width * depth * 2;
-    const layout = [
-      { id: 'voxels', type: Uint8Array, size: width * height * depth * 6 },
-      { id: 'vertices', type: Uint8Array, size: maxFaces * 4 * 8 },
-      { id: 'indices', type: Uint32Array, size: maxFaces * 6 },
-      { id: 'heightmap', type: Int32Array, size: width * depth },
-      { id: 'queueA', type: Int32Array, size: queueSize },
-      { id: 'queueB', type: Int32Array, size: queueSize },
-      { id: 'queueC', type: Int32Array, size: queueSize },
-      { id: 'world', type: Int32Array, size: 3 },
-      { id: 'bounds', type: Float32Array, size: 4 },
-    ];
-    const pages = Math.ceil(layout.reduce((total, { type, size }) => (
-      total + size * type.BYTES_PER_ELEMENT
-    ), 0) / 65536) + 2;
-    const memory = new WebAssembly.Memory({ initial: pages, maximum: pages });
-    (WebAssembly.instantiateStreaming ? (
-      WebAssembly.instantiateStreaming(fetch(wasm), { env: { memory } })
-    ) : (
-      fetch(wasm).then((res) => res.arrayBuffer()).then((buffer) => (
-        WebAssembly.instantiate(buffer, { env: { memory } })
-      ))
-    ))
-      .then(({ instance }) => {
+    this.maxFaces = maxFaces;
+    const compile = (url) => (
+      WebAssembly.compileStreaming ? (
+        WebAssembly.compileStreaming(fetch(url))
+      ) : (
+        fetch(url).then((res) => res.arrayBuffer()).then((buffer) => (
+          WebAssembly.compile(buffer)
+        ))
+      )
+    );
+    // The threaded builds need a shared memory, which is only
+    // available when the page is cross-origin isolated.
+    const canUseThreads = (
+      workers > 0
+      && typeof SharedArrayBuffer !== 'undefined'
+      && self.crossOriginIsolated
+    );
+    const canUseSIMD = VoxelWorld.supportsSIMD();
+    const variants = typeof wasm === 'string' ? { default: wasm } : wasm;
+    // Try the best supported build first and fall back to
+    // the next one if it's missing or fails to compile.
+    const candidates = [
+      { id: 'threadsSimd', threads: true, simd: true },
+      { id: 'threads', threads: true },
+      { id: 'simd', simd: true },
+      { id: 'default' },
+    ].filter(({ id, threads, simd }) => (
+      variants[id] && (!threads || canUseThreads) && (!simd || canUseSIMD)
+    ));
+    const load = ([{ id, threads }, ...fallbacks]) => (
+      compile(variants[id])
+        .then((module) => {
+          this.variant = id;
+          return { module, workers: threads ? workers : 0 };
+        })
+        .catch((e) => (fallbacks.length ? load(fallbacks) : Promise.reject(e)))
+    );
+    load(candidates)
+      .then(({ module, workers }) => {
+        const layout = [
+          ...(palette ? (
+            VoxelWorld.paletteLayout({ width, height, depth }, paletteMemory)
+          ) : [
+            { id: 'voxels', type: Uint8Array, size: width * height * depth * VoxelWorld.fields.stride },
+          ]),
+          { id: 'slice', type: Uint8Array, size: width * height * VoxelWorld.fields.stride },
+          { id: 'chunk', type: Uint8Array, size: chunkSize * chunkSize * chunkSize * 4 },
+          { id: 'vertices', type: Uint8Array, size: maxFaces * 4 * 8 },
+          { id: 'colors', type: Uint8Array, size: maxFaces * 4 },
+          // With shared indices the mesher doesn't output any
+          { id: 'indices', type: Uint32Array, size: sharedIndices ? 0 : maxFaces * 6 },
+          { id: 'heightmap', type: Int32Array, size: width * depth },
+          { id: 'queueA', type: Int32Array, size: 6 },
+          { id: 'queueB', type: Int32Array, size: 6 },
+          { id: 'queueAData', type: Int32Array, size: queueSize },
+          { id: 'queueBData', type: Int32Array, size: queueSize },
+          { id: 'edits', type: Int32Array, size: maxEdits * 7 },
+          { id: 'dirty', type: Uint32Array, size: Math.ceil((this.chunks.x * this.chunks.y * this.chunks.z) / 32) },
+          { id: 'awake', type: Uint32Array, size: Math.ceil((this.chunks.x * this.chunks.y * this.chunks.z) / 32) },
+          // The ChunkSummary of every chunk (see VoxelWorld.summaryFields)
+          { id: 'summary', type: Uint32Array, size: this.chunks.x * this.chunks.y * this.chunks.z * VoxelWorld.summaryFields.stride },
+          { id: 'world', type: Int32Array, size: 7 },
+          { id: 'bounds', type: Float32Array, size: 4 },
+          { id: 'hit', type: Int32Array, size: 6 },
+          { id: 'brushBox', type: Int32Array, size: 6 },
+          ...VoxelWorld.workerLayout(workers, maxFaces * VoxelWorld.workerArenaChunks, !sharedIndices, queueSize),
+        ];
+        const pages = Math.ceil(layout.reduce((total, { type, size }) => (
+          total + size * type.BYTES_PER_ELEMENT
+        ), 0) / 65536) + 2;
+        const memory = new WebAssembly.Memory({
+          initial: pages,
+          maximum: pages,
+          shared: workers > 0,
+        });
+        return WebAssembly.instantiate(module, { env: { memory } })
+          .then((instance) => ({
+            instance,
+            layout,
+            memory,
+            module,
+            workers,
+          }));
+      })
+      .then(({
+        instance,
+        layout,
+        memory,
+        module,
+        workers,
+      }) => {
         this._mesh = instance.exports.mesh;
-        this._generate = instance.exports.generate;
+        this._meshLOD = instance.exports.meshLOD;
+        this._generateSlab = instance.exports.generateSlab;
+        this._generateRegion = instance.exports.generateRegion;
         this._propagate = instance.exports.propagate;
+        this._propagateColumns = instance.exports.propagateColumns;
+        this._propagateSpill = instance.exports.propagateSpill;
+        this._raycast = instance.exports.raycast;
         this._simulate = instance.exports.simulate;
         this._update = instance.exports.update;
+        this._updateBatch = instance.exports.updateBatch;
+        this._brush = instance.exports.brush;
+        this._exportVoxels = instance.exports.exportVoxels;
+        this._importVoxels = instance.exports.importVoxels;
+        this._exportChunk = instance.exports.exportChunk;
+        this._importChunk = instance.exports.importChunk;
+        this._relight = instance.exports.relight;
+        this._rebuildHeightmap = instance.exports.rebuildHeightmap;
+        this._shiftVoxels = instance.exports.shiftVoxels;
+        this._clearRegion = instance.exports.clearRegion;
+        this._relightRegion = instance.exports.relightRegion;
+        this._getOccupancy = instance.exports.getOccupancy;
+        if ((instance.exports.getLayout() === 2) !== !!palette) {
+          throw new Error(
+            palette ? (
+              'The palette option requires a build with -DVOXELS_PALETTE=1'
+            ) : (
+              'This build uses the palette layout. Enable the palette option'
+            )
+          );
+        }
         let address = instance.exports.__heap_base * 1;
         layout.forEach(({ id, type, size }) => {
           this[id] = {
@@ -50,7 +183,14 @@ class VoxelWorld {
           };
           address += size * type.BYTES_PER_ELEMENT;
         });
-        this.world.view.set([width, height, depth]);
+        this.world.view.set([width, height, depth, chunkSize, this.summary.address, 0, 0]);
+        this.queueA.view.set([this.queueAData.address, queueSize]);
+        this.queueB.view.set([this.queueBData.address, queueSize]);
+        this.lightQueues = [this.queueA, this.queueB];
+        this.clearVoxels();
+        if (workers > 0) {
+          this.setupWorkers({ memory, module, workers });
+        }
         if (onLoad) {
           onLoad(this);
         }
@@ -59,7 +199,160 @@ class VoxelWorld {
       .catch((e) => console.error(e));
   }
 
-  mesh(x, y, z) {
+  static supportsSIMD() {
+    // A module with a single i8x16.popcnt
+    return WebAssembly.validate(new Uint8Array([
+      0, 97, 115, 109, 1, 0, 0, 0, 1, 5, 1, 96, 0, 1, 123, 3, 2, 1, 0, 10, 10, 1, 8, 0, 65, 0, 253, 15, 253, 98, 11,
+    ]));
+  }
+
+  static defaultWorkers() {
+    return Math.min(Math.max((navigator.hardwareConcurrency || 1) - 1, 1), 8);
+  }
+
+  static paletteLayout({ width, height, depth }, memory) {
+    // The palette layout needs a header with one entry per 32^3 chunk
+    // plus a pool where the palettes, indices and light planes get allocated.
+    const { header, chunk, chunkSize } = VoxelWorld.palette;
+    if (width % chunkSize || height % chunkSize || depth % chunkSize) {
+      throw new Error(`The palette layout requires the world size to be a multiple of ${chunkSize}`);
+    }
+    const chunks = (width / chunkSize) * (height / chunkSize) * (depth / chunkSize);
+    return [
+      { id: 'voxels', type: Uint32Array, size: header + chunks * chunk },
+      { id: 'voxelsPool', type: Uint8Array, size: Math.ceil(memory / 16) * 16 },
+    ];
+  }
+
+  static workerLayout(workers, faces, hasIndices, queueSize) {
+    // Each worker gets its own stack, an arena for the mesher output
+    // where it appends the chunks of a batch (see meshMany)
+    // and a light queue for the tiles of propagateParallel.
+    const layout = [];
+    for (let i = 0; i < workers; i += 1) {
+      layout.push(
+        { id: `worker${i}Stack`, type: Uint8Array, size: VoxelWorld.workerStackSize },
+        { id: `worker${i}Vertices`, type: Uint8Array, size: faces * 4 * 8 },
+        { id: `worker${i}Colors`, type: Uint8Array, size: faces * 4 },
+        { id: `worker${i}Indices`, type: Uint32Array, size: hasIndices ? faces * 6 : 0 },
+        { id: `worker${i}Bounds`, type: Float32Array, size: 4 },
+        { id: `worker${i}Queue`, type: Int32Array, size: 6 },
+        { id: `worker${i}QueueData`, type: Int32Array, size: queueSize }
+      );
+    }
+    return layout;
+  }
+
+  setupWorkers({ memory, module, workers }) {
+    const {
+      chunkSize,
+      maxFaces,
+      meshFlags,
+      world,
+      heightmap,
+      voxels,
+    } = this;
+    const stride = meshFlags & VoxelWorld.meshFlags.packed ? 4 : 8;
+    let requestId = 0;
+    const requests = new Map();
+    this.workers = [...Array(workers)].map((v, i) => {
+      const worker = new Worker('/core/voxels.worker.js');
+      const arena = {
+        colors: this[`worker${i}Colors`].view,
+        indices: this[`worker${i}Indices`].view,
+        vertices: this[`worker${i}Vertices`].view,
+      };
+      worker.addEventListener('message', ({ data: { id, start, results } }) => {
+        const request = requests.get(id);
+        if (!request) {
+          return;
+        }
+        if (!results) {
+          requests.delete(id);
+          request.resolve();
+          return;
+        }
+        // The geometries are views into the worker arena,
+        // which doesn't get reused until the next round.
+        results.forEach(({ bounds, faces, offset }, j) => {
+          request.onMesh(request.chunks[start + j], {
+            bounds,
+            faces,
+            ...(stride === 4 ? {
+              colors: arena.colors.subarray(offset * 4, (offset + faces) * 4),
+            } : {}),
+            ...(arena.indices.length ? {
+              indices: arena.indices.subarray(offset * 6, (offset + faces) * 6),
+            } : {}),
+            vertices: arena.vertices.subarray(offset * 4 * stride, (offset + faces) * 4 * stride),
+          }, request.indices[start + j]);
+        });
+        const next = start + results.length;
+        if (next < request.chunks.length) {
+          worker.postMessage({ type: 'mesh', id, chunks: request.chunks, start: next });
+        } else {
+          requests.delete(id);
+          request.resolve();
+        }
+      });
+      // The requests run one at a time, since they all write into the same arena
+      let queue = Promise.resolve();
+      worker.request = (chunks, indices, onMesh) => {
+        queue = queue.then(() => new Promise((resolve) => {
+          const id = requestId++;
+          requests.set(id, {
+            chunks,
+            indices,
+            onMesh,
+            resolve,
+          });
+          worker.postMessage({ type: 'mesh', id, chunks, start: 0 });
+        }));
+        return queue;
+      };
+      worker.run = (type, options) => {
+        queue = queue.then(() => new Promise((resolve) => {
+          const id = requestId++;
+          requests.set(id, { resolve });
+          worker.postMessage({ type, id, ...options });
+        }));
+        return queue;
+      };
+      const lightQueue = this[`worker${i}Queue`];
+      lightQueue.view.set([this[`worker${i}QueueData`].address, this[`worker${i}QueueData`].view.length]);
+      this.lightQueues.push(lightQueue);
+      const stack = this[`worker${i}Stack`];
+      worker.postMessage({
+        type: 'init',
+        memory,
+        module,
+        chunkSize,
+        maxFaces,
+        meshFlags,
+        // The stack grows downwards from a 16 byte aligned top
+        stack: (stack.address + stack.view.length) & ~15,
+        world: world.address,
+        heightmap: heightmap.address,
+        voxels: voxels.address,
+        arenaFaces: arena.colors.length / 4,
+        bounds: this[`worker${i}Bounds`].address,
+        indices: this[`worker${i}Indices`].address,
+        vertices: this[`worker${i}Vertices`].address,
+        colors: this[`worker${i}Colors`].address,
+        queue: lightQueue.address,
+      });
+      return worker;
+    });
+  }
+
+  mesh(x, y, z, lod = 1) {
+    return VoxelWorld.copyGeometry(this.meshInPlace(x, y, z, lod));
+  }
+
+  meshInPlace(x, y, z, lod = 1) {
+    // Same as mesh() but it doesn't copy anything: The geometry views
+    // point into the wasm memory and get overwritten by the next call.
+    // A lod of 2, 4 or 8 meshes the chunk downsampled into cells of lod^3 voxels.
     const {
       world,
       voxels,
@@ -67,72 +360,393 @@ class VoxelWorld {
       bounds,
       indices,
       vertices,
+      colors,
+      meshFlags,
     } = this;
-    const faces = this._mesh(
-      world.address,
-      voxels.address,
-      bounds.address,
-      indices.address,
-      vertices.address,
-      chunkSize,
-      x * chunkSize,
-      y * chunkSize,
-      z * chunkSize
+    const faces = lod > 1 ? (
+      this._meshLOD(
+        world.address,
+        voxels.address,
+        bounds.address,
+        indices.address,
+        vertices.address,
+        colors.address,
+        chunkSize,
+        x * chunkSize,
+        y * chunkSize,
+        z * chunkSize,
+        lod,
+        meshFlags
+      )
+    ) : (
+      this._mesh(
+        world.address,
+        voxels.address,
+        bounds.address,
+        indices.address,
+        vertices.address,
+        colors.address,
+        chunkSize,
+        x * chunkSize,
+        y * chunkSize,
+        z * chunkSize,
+        meshFlags
+      )
     );
     if (faces === -1) {
       throw new Error('Requested chunk is out of bounds');
     }
+    if (!this.meshOutput) {
+      this.meshOutput = {
+        bounds: bounds.view,
+        ...(meshFlags & VoxelWorld.meshFlags.packed ? { colors: colors.view } : {}),
+        // With shared indices every quad is drawn as 0,1,2,2,3,0
+        // (see VoxelChunk.getQuadIndices) and there's nothing to return.
+        ...(meshFlags & VoxelWorld.meshFlags.sharedIndices ? {} : { indices: indices.view }),
+        vertices: vertices.view,
+      };
+    }
+    this.meshOutput.faces = faces;
+    return this.meshOutput;
+  }
+
+  static copyGeometry({
+    bounds,
+    colors,
+    faces,
+    indices,
+    vertices,
+  }) {
+    // The packed format is 4 bytes per vertex plus the RGBA color of every face
+    const stride = colors ? 4 : 8;
     return {
-      bounds: new Float32Array(bounds.view),
-      indices: new ((faces * 4 - 1) <= 65535 ? Uint16Array : Uint32Array)(
-        indices.view.subarray(0, faces * 6)
-      ),
-      vertices: new Uint8Array(vertices.view.subarray(0, faces * 4 * 8)),
+      bounds: bounds.slice(0, 4),
+      faces,
+      ...(colors ? { colors: colors.slice(0, faces * 4) } : {}),
+      ...(indices ? {
+        indices: new ((faces * 4 - 1) <= 65535 ? Uint16Array : Uint32Array)(
+          indices.subarray(0, faces * 6)
+        ),
+      } : {}),
+      vertices: vertices.slice(0, faces * 4 * stride),
     };
   }
 
-  generate({
-    seed = Math.floor(Math.random() * 2147483647),
-    type = 0,
-    simulation = false,
-  }) {
+  meshMany(chunks, onMesh) {
+    // Meshes a list of { x, y, z, lod } chunks across the worker pool.
+    // onMesh(chunk, geometry, index) gets called as the chunks get meshed,
+    // with views of the output that are only valid until it returns.
+    // Without onMesh, it resolves to copies of the geometries in the same order as the input.
+    // The voxels must not be modified until the promise resolves.
+    if (!onMesh) {
+      const geometries = [];
+      return this.meshMany(chunks, (chunk, geometry, index) => {
+        geometries[index] = VoxelWorld.copyGeometry(geometry);
+      })
+        .then(() => geometries);
+    }
+    const { workers } = this;
+    if (!workers) {
+      chunks.forEach((chunk, index) => onMesh(chunk, this.meshInPlace(chunk.x, chunk.y, chunk.z, chunk.lod), index));
+      return Promise.resolve();
+    }
+    // The all-air chunks don't have anything to mesh,
+    // so they don't need a round trip to the workers.
+    const batches = workers.map(() => ({ chunks: [], indices: [] }));
+    let queued = 0;
+    chunks.forEach((chunk, index) => {
+      if (this.getChunkSummary(chunk).solid === 0) {
+        onMesh(chunk, this.meshInPlace(chunk.x, chunk.y, chunk.z, chunk.lod), index);
+        return;
+      }
+      const batch = batches[queued % workers.length];
+      batch.chunks.push(chunk);
+      batch.indices.push(index);
+      queued += 1;
+    });
+    return Promise.all(batches.map((batch, i) => (
+      batch.chunks.length ? workers[i].request(batch.chunks, batch.indices, onMesh) : Promise.resolve()
+    )))
+      .then(() => {});
+  }
+
+  getChunkSummary({ x, y, z }) {
+    // The solid and air voxel counts of a chunk, which generate, update,
+    // simulate and the rest keep up to date as they write the voxels.
+    // An enclosed chunk is solid and buried under solid voxels (or the world edges)
+    // on all six sides, so it's got no faces to mesh, same as the empty ones.
+    const { chunks, chunkSize, summary, world } = this;
+    const offset = ((z * chunks.y + y) * chunks.x + x) * VoxelWorld.summaryFields.stride;
+    const solid = summary.view[offset + VoxelWorld.summaryFields.solid];
+    return {
+      solid,
+      air: chunkSize * chunkSize * chunkSize - solid,
+      isEmpty: solid === 0,
+      isEnclosed: this._getOccupancy(world.address, x, y, z) === VoxelWorld.occupancy.enclosed,
+    };
+  }
+
+  getVisibleChunks(position) {
+    // Walks the chunks outwards from the one that contains the position (in voxels).
+    // It only leaves a chunk through a face that the air of the chunk connects
+    // with the face it came in from, and it never turns back along any axis.
+    // The connections come from the last time the chunks were meshed.
+    // Returns a flag per chunk (x, then y, then z) that is 1 for the chunks
+    // that can be seen from there, or false if the position is out of the world.
+    const { chunks, chunkSize, summary } = this;
+    const { stride, visibility } = VoxelWorld.summaryFields;
+    const x = Math.floor(position.x / chunkSize);
+    const y = Math.floor(position.y / chunkSize);
+    const z = Math.floor(position.z / chunkSize);
+    if (
+      x < 0 || x >= chunks.x
+      || y < 0 || y >= chunks.y
+      || z < 0 || z >= chunks.z
+    ) {
+      return false;
+    }
+    const count = chunks.x * chunks.y * chunks.z;
+    if (!this.visibleChunks) {
+      this.visibleChunks = new Uint8Array(count);
+      // Every entry is the chunk index, the face it came in from and the faces it left through
+      this.visibilityQueue = new Uint32Array(count);
+    }
+    const { visibleChunks: visible, visibilityQueue: queue } = this;
+    const steps = [1, -1, chunks.x * chunks.y, -chunks.x * chunks.y, chunks.x, -chunks.x];
+    visible.fill(0);
+    const start = (z * chunks.y + y) * chunks.x + x;
+    visible[start] = 1;
+    // 6 means it didn't come in from any face
+    queue[0] = (start << 9) | (6 << 6);
+    for (let head = 0, tail = 1; head < tail; head += 1) {
+      const index = queue[head] >>> 9;
+      const entry = (queue[head] >> 6) & 7;
+      const travelled = queue[head] & 63;
+      const connected = summary.view[index * stride + visibility];
+      const cx = index % chunks.x;
+      const cy = Math.floor(index / chunks.x) % chunks.y;
+      const cz = Math.floor(index / (chunks.x * chunks.y));
+      for (let face = 0; face < 6; face += 1) {
+        if (
+          (travelled & (1 << (face ^ 1)))
+          || (entry !== 6 && !(connected & (1 << VoxelWorld.getFacePair(entry, face))))
+        ) {
+          continue;
+        }
+        const axis = face >> 1;
+        const coordinate = axis === 0 ? cx : (axis === 1 ? cz : cy);
+        const limit = axis === 0 ? chunks.x : (axis === 1 ? chunks.z : chunks.y);
+        if (face & 1 ? coordinate === 0 : coordinate === limit - 1) {
+          continue;
+        }
+        const neighbor = index + steps[face];
+        if (!visible[neighbor]) {
+          visible[neighbor] = 1;
+          queue[tail] = (neighbor << 9) | ((face ^ 1) << 6) | travelled | (1 << face);
+          tail += 1;
+        }
+      }
+    }
+    return visible;
+  }
+
+  static getFacePair(a, b) {
+    // Same as getFacePair in core/voxels.c.
+    // The faces are +x, -x, +z, -z, +y and -y.
+    const min = Math.min(a, b);
+    const max = Math.max(a, b);
+    return (min * (11 - min)) / 2 + max - min - 1;
+  }
+
+  getLOD({ x, y, z }, position) {
+    // Picks the chunk mesh coarseness (1, 2, 4 or 8) by the distance
+    // from the chunk center to a position in voxels.
+    const { chunkSize, lodDistances } = this;
+    const half = chunkSize * 0.5;
+    const dx = x * chunkSize + half - position.x;
+    const dy = y * chunkSize + half - position.y;
+    const dz = z * chunkSize + half - position.z;
+    const distance = Math.sqrt(dx * dx + dy * dy + dz * dz);
+    let lod = 1;
+    for (let i = 0; i < lodDistances.length && lod < 8 && distance > lodDistances[i]; i += 1) {
+      lod *= 2;
+    }
+    return lod;
+  }
+
+  generate(options = {}) {
+    // Generates the world on the main thread (see generateParallel)
     const {
+      depth,
       world,
       heightmap,
       voxels,
-      queueA,
-      queueB,
     } = this;
-    heightmap.view.fill(0);
-    voxels.view.fill(0);
-    this._generate(
+    const { seed, type, flags } = this.resetGeneration(options);
+    this._generateSlab(
       world.address,
       heightmap.address,
       voxels.address,
       seed,
-      type
+      type,
+      flags,
+      0,
+      depth
     );
-    if (simulation) {
-      // ToDo/Incomplete
-      // This is a bit of a hack for the animation test.
-      // The ideal solution will be keeping this light levels at 0
-      // and then have an optional parameter in the mesher so it can
-      // ignore the light levels when building the chunk faces
-      for (let i = 0, l = voxels.view.length; i < l; i += 6) {
-        if (voxels.view[i] === 1) {
-          voxels.view[i] = 3;
+    this.finishGeneration(options);
+  }
+
+  generateParallel(options = {}) {
+    // Splits the world into z slabs that get generated across the worker pool,
+    // and then propagates the light across it too (see propagateParallel).
+    // The output is the same as generate() no matter the number of workers.
+    // The palette layout allocates from a shared pool, so it runs on the main thread.
+    const {
+      chunkSize,
+      depth,
+      voxelsPool,
+      workers,
+    } = this;
+    if (!workers || voxelsPool) {
+      this.generate(options);
+      return Promise.resolve();
+    }
+    const { seed, type, flags } = this.resetGeneration(options);
+    const batches = workers.map(() => []);
+    for (let z = 0, i = 0; z < depth; z += chunkSize, i += 1) {
+      batches[i % workers.length].push({ from: z, to: Math.min(z + chunkSize, depth) });
+    }
+    return Promise.all(batches.map((slabs, i) => (
+      slabs.length ? workers[i].run('generate', {
+        seed,
+        type,
+        flags,
+        slabs,
+      }) : Promise.resolve()
+    )))
+      .then(() => {
+        if (options.simulation) {
+          this.convertToSand();
         }
-        voxels.view[i + 5] = 32;
-      }
-    } else {
+        return this.propagateParallel();
+      });
+  }
+
+  propagateParallel() {
+    // Same as the initial _propagate, split across the worker pool.
+    // The sunlight columns of every z slab are independent. The sideways spill
+    // can't light anything further than maxLight - 1 voxels from its tile,
+    // so the tiles get 3 colors along x and along z and it runs in nine passes,
+    // one per color. The tiles of a color never touch the same voxels, so all
+    // of them are in flight at once.
+    const {
+      width,
+      depth,
+      voxelsPool,
+      workers,
+      world,
+      heightmap,
+      voxels,
+      queueA,
+    } = this;
+    if (!workers || voxelsPool) {
       this._propagate(
         world.address,
         heightmap.address,
         voxels.address,
-        queueA.address,
-        queueB.address
+        queueA.address
       );
+      this.checkQueues();
+      return Promise.resolve();
+    }
+    const { propagateTile } = VoxelWorld;
+    const slabs = [];
+    const colors = [...Array(9)].map(() => []);
+    for (let z = 0, tz = 0; z < depth; z += propagateTile, tz += 1) {
+      const toZ = Math.min(z + propagateTile, depth);
+      slabs.push({ fromX: 0, toX: width, fromZ: z, toZ });
+      for (let x = 0, tx = 0; x < width; x += propagateTile, tx += 1) {
+        colors[(tz % 3) * 3 + (tx % 3)].push({
+          fromX: x,
+          toX: Math.min(x + propagateTile, width),
+          fromZ: z,
+          toZ,
+        });
+      }
     }
+    const run = (pass, tiles) => {
+      const batches = workers.map(() => []);
+      tiles.forEach((tile, i) => batches[i % workers.length].push(tile));
+      return Promise.all(batches.map((batch, i) => (
+        batch.length ? workers[i].run('propagate', { pass, tiles: batch }) : Promise.resolve()
+      )));
+    };
+    return colors.reduce((promise, tiles) => promise.then(() => (
+      run('spill', tiles)
+    )), run('columns', slabs))
+      .then(() => this.checkQueues());
+  }
+
+  resetGeneration({
+    seed = Math.floor(Math.random() * 2147483647),
+    type = 0,
+    interpolated = false,
+  }) {
+    const {
+      heightmap,
+      dirty,
+      awake,
+    } = this;
+    heightmap.view.fill(0);
+    this.clearVoxels();
+    dirty.view.fill(0xFFFFFFFF);
+    awake.view.fill(0xFFFFFFFF);
+    this.unsaved.fill(0xFFFFFFFF);
+    return {
+      seed,
+      type,
+      flags: interpolated ? VoxelWorld.generateFlags.interpolated : 0,
+    };
+  }
+
+  convertToSand() {
+    // The animation test turns all the stone into sand
+    const {
+      depth,
+      world,
+      voxels,
+      slice,
+    } = this;
+    const { type: typeField, stride } = VoxelWorld.fields;
+    for (let z = 0; z < depth; z += 1) {
+      this._exportVoxels(world.address, voxels.address, z, slice.address);
+      for (let i = 0, l = slice.view.length; i < l; i += stride) {
+        if (slice.view[i + typeField] === 1) {
+          slice.view[i + typeField] = 3;
+        }
+      }
+      this._importVoxels(world.address, voxels.address, z, slice.address);
+    }
+  }
+
+  finishGeneration({ simulation = false }) {
+    const {
+      world,
+      heightmap,
+      voxels,
+      queueA,
+    } = this;
+    if (simulation) {
+      this.convertToSand();
+    }
+    this._propagate(
+      world.address,
+      heightmap.address,
+      voxels.address,
+      queueA.address
+    );
+    this.checkQueues();
+    this.checkPool();
   }
 
   simulate(steps) {
@@ -140,16 +754,40 @@ class VoxelWorld {
       world,
       heightmap,
       voxels,
+      dirty,
+      awake,
+      queueA,
+      queueB,
+      edits,
+      unsaved,
     } = this;
+    // The sand <-> stone flips don't flag the chunks as dirty, so they don't
+    // reach trackUnsavedChunks. They only happen in the chunks a step sweeps,
+    // which are the ones awake when it starts plus the ones it wakes up.
+    const trackAwakeChunks = () => awake.view.forEach((bits, i) => {
+      unsaved[i] |= bits;
+    });
     for (let i = 0; i < steps; i += 1) {
+      trackAwakeChunks();
+      // The edits buffer collects the voxels that need relighting
       this._simulate(
         world.address,
         heightmap.address,
         voxels.address,
+        dirty.address,
+        awake.address,
+        queueA.address,
+        queueB.address,
+        edits.address,
+        edits.view.length,
         this.simulationStep
       );
       this.simulationStep += 1;
     }
+    trackAwakeChunks();
+    this.trackEditedColumns();
+    this.checkQueues();
+    this.checkPool();
   }
 
   update({
@@ -161,21 +799,672 @@ class VoxelWorld {
       world,
       heightmap,
       voxels,
+      dirty,
       queueA,
       queueB,
-      queueC,
     } = this;
     this._update(
       world.address,
       heightmap.address,
       voxels.address,
+      dirty.address,
       queueA.address,
       queueB.address,
-      queueC.address,
       type,
       x, y, z,
       r, g, b
     );
+    this.wakeDirtyChunks();
+    this.trackEditedColumns();
+    this.checkQueues();
+    this.checkPool();
+  }
+
+  updateBatch(edits) {
+    // Applies a list of { type, x, y, z, r, g, b } edits
+    // with a single light pass per maxEdits.
+    // Returns the chunks that need to be remeshed.
+    const {
+      world,
+      heightmap,
+      voxels,
+      dirty,
+      queueA,
+      queueB,
+      maxEdits,
+    } = this;
+    for (let offset = 0; offset < edits.length; offset += maxEdits) {
+      const count = Math.min(edits.length - offset, maxEdits);
+      for (let i = 0, j = 0; i < count; i += 1, j += 7) {
+        const {
+          type,
+          x, y, z,
+          r, g, b,
+        } = edits[offset + i];
+        this.edits.view.set([x, y, z, type, r, g, b], j);
+      }
+      this._updateBatch(
+        world.address,
+        heightmap.address,
+        voxels.address,
+        dirty.address,
+        queueA.address,
+        queueB.address,
+        this.edits.address,
+        count
+      );
+    }
+    this.wakeDirtyChunks();
+    this.trackEditedColumns();
+    this.checkQueues();
+    this.checkPool();
+    return this.getDirtyChunks();
+  }
+
+  brush({
+    shape = VoxelWorld.brushShapes.sphere,
+    size,
+    x, y, z,
+    type,
+    color: { r, g, b },
+    noise = 0,
+    seed = Math.floor(Math.random() * 2147483647),
+  }) {
+    // Stamps a whole brush (same shapes as Controls.getBrush) in a single call.
+    // The color of each voxel gets jittered by noise (0 to 1) in the C side.
+    // Returns the amount of voxels stamped and the range of chunks it touched.
+    const {
+      world,
+      heightmap,
+      voxels,
+      dirty,
+      queueA,
+      queueB,
+      edits,
+      maxEdits,
+      brushBox,
+    } = this;
+    const count = this._brush(
+      world.address,
+      heightmap.address,
+      voxels.address,
+      dirty.address,
+      queueA.address,
+      queueB.address,
+      edits.address,
+      maxEdits,
+      brushBox.address,
+      shape,
+      size,
+      x, y, z,
+      type,
+      r, g, b,
+      noise,
+      seed
+    );
+    this.wakeDirtyChunks();
+    this.trackEditedColumns();
+    this.checkQueues();
+    this.checkPool();
+    const [fromX, fromY, fromZ, toX, toY, toZ] = brushBox.view;
+    return {
+      count,
+      from: { x: fromX, y: fromY, z: fromZ },
+      to: { x: toX, y: toY, z: toZ },
+    };
+  }
+
+  wakeDirtyChunks() {
+    // Wakes up the simulation on the chunks around the edits.
+    // The dirty set covers them plus their 1 voxel apron, so this
+    // must run before getDirtyChunks() clears it.
+    const { awake, dirty } = this;
+    dirty.view.forEach((bits, i) => {
+      awake.view[i] |= bits;
+    });
+  }
+
+  trackEditedColumns() {
+    // With the streaming option, flags the columns around the edits so they get
+    // cached when they leave the world. Same as wakeDirtyChunks, it runs before
+    // getDirtyChunks() clears the dirty set.
+    const { chunks, dirty, streaming } = this;
+    if (!streaming) {
+      return;
+    }
+    dirty.view.forEach((bits, i) => {
+      while (bits !== 0) {
+        const bit = 31 - Math.clz32(bits);
+        bits ^= (1 << bit);
+        const chunk = i * 32 + bit;
+        const x = chunk % chunks.x;
+        const z = Math.floor(chunk / (chunks.x * chunks.y));
+        if (z < chunks.z) {
+          streaming.edited[z * chunks.x + x] = 1;
+        }
+      }
+    });
+  }
+
+  startStreaming(position, {
+    seed = Math.floor(Math.random() * 2147483647),
+    interpolated = false,
+  } = {}) {
+    // Generates the whole world centered on a position (in world voxels)
+    // and drops the cached columns of any previous one. See stream.
+    const {
+      width,
+      depth,
+      world,
+      heightmap,
+      voxels,
+      queueA,
+      streaming,
+    } = this;
+    if (!streaming) {
+      throw new Error('Streaming requires the streaming option');
+    }
+    const { flags } = this.resetGeneration({ seed, interpolated });
+    streaming.seed = seed;
+    streaming.flags = flags;
+    streaming.cache.clear();
+    streaming.edited.fill(0);
+    this.origin = this.getStreamingOrigin(position);
+    this._generateRegion(
+      world.address,
+      heightmap.address,
+      voxels.address,
+      seed,
+      0,
+      flags,
+      this.origin.x,
+      this.origin.z,
+      0,
+      width,
+      0,
+      depth
+    );
+    this._propagate(
+      world.address,
+      heightmap.address,
+      voxels.address,
+      queueA.address
+    );
+    this.checkQueues();
+    this.checkPool();
+  }
+
+  stream(position) {
+    // Paged world (streaming option): The memory only holds a window of width x depth
+    // voxels of an endless terrain, which slides in whole chunks to stay centered on
+    // a position in world voxels. The columns that leave it get dropped, or cached
+    // if they were edited, and the ones that come in get restored or generated.
+    // The cache keeps every edited column, deflated unless it's next to the world,
+    // so the edits are never lost and the rest only cost their compressed size.
+    // It waits for the cached columns that come in to get inflated: until then,
+    // it returns false without moving, so it should be called again on the next frame.
+    // The light gets recomputed on the new columns and on the ones that were next
+    // to the dropped ones, since that's as far as the light of those could reach.
+    // It only clears it here and leaves the relighting to relightStreamed, which
+    // the caller should run on the next frames. Until then, getDirtyChunks leaves
+    // those chunks out, so they keep their previous meshes (or none).
+    // Returns the amount of chunks it moved ({ x, z }) or false.
+    // Everything is in memory coordinates: origin is the world voxel of (0, 0, 0).
+    // The voxels must not be read by the workers while it runs.
+    const {
+      chunkSize,
+      chunks,
+      width,
+      depth,
+      world,
+      heightmap,
+      voxels,
+      dirty,
+      awake,
+      queueA,
+      streaming,
+    } = this;
+    const target = this.getStreamingOrigin(position);
+    const dx = target.x - this.origin.x;
+    const dz = target.z - this.origin.z;
+    if (dx === 0 && dz === 0) {
+      return false;
+    }
+    if (!this.prefetchColumns(target)) {
+      return false;
+    }
+    const cdx = dx / chunkSize;
+    const cdz = dz / chunkSize;
+    // When it jumps that far, the bands it would relight overlap,
+    // so it just reloads and relights the whole world.
+    const isJump = Math.abs(cdx) > chunks.x - 2 || Math.abs(cdz) > chunks.z - 2;
+    const isInside = (x, z) => !isJump && x >= 0 && x < chunks.x && z >= 0 && z < chunks.z;
+    // The pending pieces are in the coordinates of the previous step
+    this.relightStreamed(Infinity);
+    // The chunks that were waiting to be remeshed move along with the voxels
+    const pending = this.getDirtyChunks();
+    for (let z = 0; z < chunks.z; z += 1) {
+      for (let x = 0; x < chunks.x; x += 1) {
+        if (!isInside(x - cdx, z - cdz)) {
+          this.evictColumn(x, z);
+        }
+      }
+    }
+    const edited = streaming.edited.slice();
+    streaming.edited.fill(0);
+    for (let z = 0; z < chunks.z; z += 1) {
+      for (let x = 0; x < chunks.x; x += 1) {
+        if (isInside(x + cdx, z + cdz)) {
+          streaming.edited[z * chunks.x + x] = edited[(z + cdz) * chunks.x + x + cdx];
+        }
+      }
+    }
+    if (isJump) {
+      this.clearVoxels();
+      heightmap.view.fill(0);
+    } else {
+      this._shiftVoxels(world.address, heightmap.address, voxels.address, dx, dz);
+    }
+    this.origin = target;
+    for (let z = 0; z < chunks.z; z += 1) {
+      for (let x = 0; x < chunks.x; x += 1) {
+        if (!isInside(x + cdx, z + cdz)) {
+          this.loadColumn(x, z);
+        }
+      }
+    }
+    if (isJump) {
+      this._relight(
+        world.address,
+        heightmap.address,
+        voxels.address,
+        queueA.address
+      );
+      dirty.view.fill(0xFFFFFFFF);
+    } else {
+      // All the bands get cleared before any piece gets relit, so the pieces
+      // only pull in the light of the columns that were already right.
+      // The result is the same as relighting the whole bands in one go.
+      const clearBand = (fromX, toX, fromZ, toZ) => {
+        this._clearRegion(
+          world.address,
+          heightmap.address,
+          voxels.address,
+          fromX,
+          toX,
+          fromZ,
+          toZ
+        );
+        for (let z = fromZ / chunkSize; z < toZ / chunkSize; z += 1) {
+          for (let x = fromX / chunkSize; x < toX / chunkSize; x += 1) {
+            // The x and z bands share their corners
+            if (!streaming.relight.some((column) => column.x === x && column.z === z)) {
+              streaming.relight.push({ x, z });
+            }
+          }
+        }
+      };
+      // The new columns go first, so the edge of the world shows up sooner
+      if (dx !== 0) {
+        clearBand(dx > 0 ? width - dx : 0, dx > 0 ? width : -dx, 0, depth);
+      }
+      if (dz !== 0) {
+        clearBand(0, width, dz > 0 ? depth - dz : 0, dz > 0 ? depth : -dz);
+      }
+      if (dx !== 0) {
+        clearBand(dx > 0 ? 0 : width - chunkSize, dx > 0 ? chunkSize : width, 0, depth);
+      }
+      if (dz !== 0) {
+        clearBand(0, width, dz > 0 ? 0 : depth - chunkSize, dz > 0 ? chunkSize : depth);
+      }
+      pending.forEach(({ x, y, z }) => {
+        if (isInside(x - cdx, z - cdz)) {
+          const chunk = (z - cdz) * chunks.x * chunks.y + y * chunks.x + (x - cdx);
+          dirty.view[chunk >> 5] |= 1 << (chunk & 31);
+        }
+      });
+    }
+    awake.view.fill(0xFFFFFFFF);
+    this.unsaved.fill(0xFFFFFFFF);
+    this.checkQueues();
+    this.checkPool();
+    this.prefetchColumns();
+    return { x: cdx, z: cdz };
+  }
+
+  relightStreamed(budget = 4) {
+    // Relights the chunk columns left pending by stream, in the order they
+    // were queued, until it runs out of them or of budget (in milliseconds).
+    // It always relights at least one. Returns true if it relit any.
+    // Same as stream, the voxels must not be read by the workers while it runs.
+    const {
+      chunkSize,
+      world,
+      heightmap,
+      voxels,
+      dirty,
+      queueA,
+      streaming,
+    } = this;
+    if (!streaming || !streaming.relight.length) {
+      return false;
+    }
+    const start = performance.now();
+    do {
+      const { x, z } = streaming.relight.shift();
+      this._relightRegion(
+        world.address,
+        heightmap.address,
+        voxels.address,
+        dirty.address,
+        queueA.address,
+        x * chunkSize,
+        (x + 1) * chunkSize,
+        z * chunkSize,
+        (z + 1) * chunkSize
+      );
+    } while (streaming.relight.length && performance.now() - start < budget);
+    this.checkQueues();
+    this.checkPool();
+    return true;
+  }
+
+  isRelightPending({ x, z }) {
+    // Whether the light of a chunk column isn't final yet: After a stream step,
+    // until it gets relit. While importing, until it and the ones around get relit.
+    const { chunks, importing, streaming } = this;
+    if (importing) {
+      for (let nz = Math.max(z - 1, 0); nz <= Math.min(z + 1, chunks.z - 1); nz += 1) {
+        for (let nx = Math.max(x - 1, 0); nx <= Math.min(x + 1, chunks.x - 1); nx += 1) {
+          if (!importing.relit[nz * chunks.x + nx]) {
+            return true;
+          }
+        }
+      }
+    }
+    return !!streaming && streaming.relight.some((column) => column.x === x && column.z === z);
+  }
+
+  getStreamingOrigin({ x, z }) {
+    // The origin that centers the world on the chunk of a position in world voxels
+    const { chunkSize, chunks } = this;
+    return {
+      x: (Math.floor(x / chunkSize) - Math.floor(chunks.x / 2)) * chunkSize,
+      z: (Math.floor(z / chunkSize) - Math.floor(chunks.z / 2)) * chunkSize,
+    };
+  }
+
+  evictColumn(x, z) {
+    // Keeps the chunks of an edited column that is leaving the world.
+    // The rest can be generated again from the seed.
+    // They get deflated in the pako worker, and prefetchColumns drops the raw
+    // data once they are and the column is far enough.
+    if (!this.pako) this.setupPakoWorker();
+    const {
+      chunkSize,
+      chunks,
+      origin,
+      world,
+      voxels,
+      chunk,
+      pako,
+      streaming,
+    } = this;
+    if (!streaming.edited[z * chunks.x + x]) {
+      return;
+    }
+    const column = [];
+    for (let y = 0; y < chunks.y; y += 1) {
+      const blocks = this._exportChunk(
+        world.address,
+        voxels.address,
+        x * chunkSize,
+        y * chunkSize,
+        z * chunkSize,
+        chunk.address
+      );
+      if (blocks === 0) {
+        column.push(null);
+        continue;
+      }
+      const cached = { data: chunk.view.slice(), deflated: null };
+      pako.request({ data: cached.data.slice(), operation: 'deflate' })
+        .then((deflated) => { cached.deflated = deflated; });
+      column.push(cached);
+    }
+    streaming.cache.set(`${origin.x / chunkSize + x},${origin.z / chunkSize + z}`, column);
+  }
+
+  prefetchColumns(origin = this.origin) {
+    // Inflates the deflated columns in the cache that are in the world at an origin
+    // or next to it, which is as far as the next stream step can bring in, and drops
+    // the raw data of the rest. Returns true if the ones in the world are ready.
+    const {
+      chunkSize,
+      chunks,
+      pako,
+      streaming,
+    } = this;
+    const ox = origin.x / chunkSize;
+    const oz = origin.z / chunkSize;
+    let ready = true;
+    streaming.cache.forEach((column, key) => {
+      const [x, z] = key.split(',').map(Number);
+      // 0 or less is inside the world
+      const distance = Math.max(ox - x, x - (ox + chunks.x - 1), oz - z, z - (oz + chunks.z - 1));
+      column.forEach((cached) => {
+        if (!cached || !cached.deflated) {
+          // Still being deflated, so it has the raw data
+          return;
+        }
+        if (distance > 1) {
+          cached.data = null;
+          return;
+        }
+        if (cached.data) {
+          return;
+        }
+        if (distance <= 0) {
+          ready = false;
+        }
+        if (!cached.inflating) {
+          cached.inflating = pako.request({ data: cached.deflated.slice(), operation: 'inflate' })
+            .then((data) => {
+              cached.data = data;
+              cached.inflating = null;
+            });
+        }
+      });
+    });
+    return ready;
+  }
+
+  loadColumn(x, z) {
+    // Fills a column that is coming into the world (which must be empty)
+    const {
+      chunkSize,
+      chunks,
+      origin,
+      world,
+      heightmap,
+      voxels,
+      chunk,
+      streaming,
+    } = this;
+    const key = `${origin.x / chunkSize + x},${origin.z / chunkSize + z}`;
+    const column = streaming.cache.get(key);
+    if (!column) {
+      this._generateRegion(
+        world.address,
+        heightmap.address,
+        voxels.address,
+        streaming.seed,
+        0,
+        streaming.flags,
+        origin.x,
+        origin.z,
+        x * chunkSize,
+        (x + 1) * chunkSize,
+        z * chunkSize,
+        (z + 1) * chunkSize
+      );
+      return;
+    }
+    streaming.cache.delete(key);
+    streaming.edited[z * chunks.x + x] = 1;
+    column.forEach((cached, y) => {
+      if (!cached) {
+        return;
+      }
+      chunk.view.set(cached.data);
+      this._importChunk(
+        world.address,
+        heightmap.address,
+        voxels.address,
+        x * chunkSize,
+        y * chunkSize,
+        z * chunkSize,
+        chunk.address
+      );
+    });
+  }
+
+  raycast({ origin, direction, maxDistance = 256 }) {
+    // Returns the first block along the ray and the normal of the face it
+    // hit, or false if there's none within maxDistance.
+    // Everything is in voxel units and the direction must be normalized.
+    const { world, voxels, hit } = this;
+    const distance = this._raycast(
+      world.address,
+      voxels.address,
+      hit.address,
+      origin.x, origin.y, origin.z,
+      direction.x, direction.y, direction.z,
+      maxDistance
+    );
+    if (distance === -1) {
+      return false;
+    }
+    return {
+      distance,
+      position: { x: hit.view[0], y: hit.view[1], z: hit.view[2] },
+      normal: { x: hit.view[3], y: hit.view[4], z: hit.view[5] },
+    };
+  }
+
+  getDirtyChunks() {
+    // Returns the chunks whose voxels or light changed since the
+    // last call and clears the set, so they can be remeshed.
+    // The columns still waiting for their light (see stream) are left out,
+    // relightStreamed flags them again once they're relit.
+    const { chunks, dirty } = this;
+    const count = chunks.x * chunks.y * chunks.z;
+    const list = [];
+    this.trackUnsavedChunks();
+    dirty.view.forEach((bits, i) => {
+      while (bits !== 0) {
+        const bit = 31 - Math.clz32(bits);
+        bits ^= (1 << bit);
+        const chunk = i * 32 + bit;
+        if (chunk >= count) {
+          continue;
+        }
+        const position = {
+          x: chunk % chunks.x,
+          y: Math.floor(chunk / chunks.x) % chunks.y,
+          z: Math.floor(chunk / (chunks.x * chunks.y)),
+        };
+        if (!this.isRelightPending(position)) {
+          list.push(position);
+        }
+      }
+    });
+    dirty.view.fill(0);
+    return list;
+  }
+
+  trackUnsavedChunks() {
+    // Everything that modifies the voxels flags the dirty set,
+    // so this must run before getDirtyChunks() clears it.
+    const { dirty, unsaved } = this;
+    dirty.view.forEach((bits, i) => {
+      unsaved[i] |= bits;
+    });
+  }
+
+  getQueueStats(reset = false) {
+    // Peak occupancy and dropped entries since the last reset.
+    // Use it to size the queueSize option for larger worlds.
+    const { lightQueues } = this;
+    const stats = {
+      capacity: lightQueues[0].view[1],
+      peak: Math.max(...lightQueues.map(({ view }) => view[4])),
+      overflow: lightQueues.reduce((total, { view }) => total + view[5], 0),
+    };
+    if (reset) {
+      lightQueues.forEach(({ view }) => view.fill(0, 4));
+    }
+    return stats;
+  }
+
+  checkQueues() {
+    const { lightQueues } = this;
+    if (lightQueues.every(({ view }) => view[5] === 0)) {
+      return;
+    }
+    const { capacity, peak, overflow } = this.getQueueStats(true);
+    console.warn(
+      `Light queues overflowed: ${overflow} entries were dropped (capacity: ${capacity}, peak: ${peak}).\n`
+      + 'Lighting may be incomplete. Increase the queueSize option.'
+    );
+  }
+
+  clearVoxels() {
+    const {
+      summary,
+      voxels,
+      voxelsPool,
+      streaming,
+    } = this;
+    voxels.view.fill(0);
+    summary.view.fill(0);
+    if (voxelsPool) {
+      voxels.view.set([voxelsPool.address, voxelsPool.view.length]);
+    }
+    if (streaming) {
+      // Whatever fills the voxels again computes the light of all of them
+      streaming.relight.length = 0;
+    }
+  }
+
+  getPoolStats(reset = false) {
+    // Bytes reserved from the palette pool and writes that were
+    // dropped because it was full. Use it to size the paletteMemory option.
+    const { voxels, voxelsPool } = this;
+    if (!voxelsPool) {
+      return false;
+    }
+    const stats = {
+      capacity: voxels.view[1],
+      used: voxels.view[2],
+      overflow: voxels.view[3],
+    };
+    if (reset) {
+      voxels.view[3] = 0;
+    }
+    return stats;
+  }
+
+  checkPool() {
+    const { voxels, voxelsPool } = this;
+    if (!voxelsPool || voxels.view[3] === 0) {
+      return;
+    }
+    const { capacity, overflow } = this.getPoolStats(true);
+    console.warn(
+      `Palette pool overflowed: ${overflow} writes were dropped (capacity: ${capacity}).\n`
+      + 'Some voxels may be missing. Increase the paletteMemory option.'
+    );
   }
 
   setupPakoWorker() {
@@ -198,40 +1487,336 @@ class VoxelWorld {
   }
 
   exportVoxels() {
+    // Saves the world as a v2 .blocks file (see VoxelWorld.blocks).
+    // Only the chunks modified since the last save or load get compressed,
+    // the rest reuse the data from back then.
     if (!this.pako) this.setupPakoWorker();
-    const { voxels, pako } = this;
-    return pako.request({ data: new Uint8Array(voxels.view), operation: 'deflate' });
+    const {
+      chunks,
+      chunkSize,
+      world,
+      voxels,
+      chunk,
+      pako,
+      savedChunks,
+      unsaved,
+    } = this;
+    this.trackUnsavedChunks();
+    const count = chunks.x * chunks.y * chunks.z;
+    const requests = [];
+    for (let i = 0; i < count; i += 1) {
+      if (!(unsaved[i >> 5] & (1 << (i & 31))) && savedChunks[i]) {
+        continue;
+      }
+      const blocks = this.summary.view[i * VoxelWorld.summaryFields.stride] === 0 ? 0 : this._exportChunk(
+        world.address,
+        voxels.address,
+        (i % chunks.x) * chunkSize,
+        (Math.floor(i / chunks.x) % chunks.y) * chunkSize,
+        Math.floor(i / (chunks.x * chunks.y)) * chunkSize,
+        chunk.address
+      );
+      if (blocks === 0) {
+        savedChunks[i] = new Uint8Array(0);
+        continue;
+      }
+      requests.push(
+        pako.request({ data: new Uint8Array(chunk.view), operation: 'deflate' })
+          .then((data) => { savedChunks[i] = data; })
+      );
+    }
+    unsaved.fill(0);
+    return Promise.all(requests)
+      .then(() => {
+        const { magic, version, header } = VoxelWorld.blocks;
+        const index = header + count * 2;
+        const size = savedChunks.reduce((size, data) => size + data.length, index * 4);
+        const buffer = new Uint8Array(size);
+        const view = new DataView(buffer.buffer);
+        [magic, version, this.width, this.height, this.depth, chunkSize].forEach((value, i) => (
+          view.setUint32(i * 4, value, true)
+        ));
+        for (let i = 0, offset = index * 4; i < count; i += 1) {
+          const data = savedChunks[i];
+          view.setUint32((header + i * 2) * 4, offset, true);
+          view.setUint32((header + i * 2 + 1) * 4, data.length, true);
+          buffer.set(data, offset);
+          offset += data.length;
+        }
+        return buffer;
+      });
   }
 
-  importVoxels(deflated) {
+  importVoxels(buffer, { onProgress, relight = false } = {}) {
+    // Loads both the v2 .blocks files and the legacy ones, which are the
+    // deflated interleaved voxels of the whole world.
+    // onProgress(loaded, total) gets called as the v2 chunks come in.
+    // The v2 files don't store the light, so it's always computed for them.
+    // With relight, the light stored in the legacy files gets recomputed too.
     if (!this.pako) this.setupPakoWorker();
+    const view = new DataView(buffer.buffer, buffer.byteOffset, buffer.byteLength);
+    if (buffer.byteLength >= 4 && view.getUint32(0, true) === VoxelWorld.blocks.magic) {
+      return this.importChunks(buffer, view, onProgress);
+    }
+    return this.importLegacyVoxels(buffer, relight);
+  }
+
+  importChunks(buffer, view, onProgress) {
+    // The chunks get relit as they come in: A column of chunks gets relit once
+    // it and the columns around it are in, since that's as far as the light of
+    // those can reach. Until then, getDirtyChunks leaves its chunks out (see
+    // isRelightPending), so every chunk gets meshed once, with its final light.
+    // If any chunk is corrupt, the rest get ignored and the world ends up empty.
+    const {
+      chunks,
+      chunkSize,
+      world,
+      heightmap,
+      voxels,
+      chunk,
+      dirty,
+      awake,
+      queueA,
+      pako,
+      unsaved,
+    } = this;
+    const { version, header } = VoxelWorld.blocks;
+    const count = chunks.x * chunks.y * chunks.z;
+    if (
+      buffer.byteLength < (header + count * 2) * 4
+      || view.getUint32(4, true) !== version
+      || view.getUint32(8, true) !== this.width
+      || view.getUint32(12, true) !== this.height
+      || view.getUint32(16, true) !== this.depth
+      || view.getUint32(20, true) !== chunkSize
+    ) {
+      return Promise.reject(new Error('The .blocks file doesn\'t match the world size'));
+    }
+    const savedChunks = [];
+    // The chunks with data that every column is still waiting for
+    const remaining = new Uint32Array(chunks.x * chunks.z);
+    for (let i = 0; i < count; i += 1) {
+      const offset = view.getUint32((header + i * 2) * 4, true);
+      const length = view.getUint32((header + i * 2 + 1) * 4, true);
+      if (offset + length > buffer.byteLength) {
+        return Promise.reject(new Error('The .blocks file is truncated'));
+      }
+      savedChunks[i] = buffer.subarray(offset, offset + length);
+      if (length > 0) {
+        remaining[Math.floor(i / (chunks.x * chunks.y)) * chunks.x + (i % chunks.x)] += 1;
+      }
+    }
+    heightmap.view.fill(0);
+    this.clearVoxels();
+    dirty.view.fill(0);
+    const importing = {
+      relit: new Uint8Array(chunks.x * chunks.z),
+    };
+    this.importing = importing;
+    const forEachAround = (x, z, fn) => {
+      for (let nz = Math.max(z - 1, 0); nz <= Math.min(z + 1, chunks.z - 1); nz += 1) {
+        for (let nx = Math.max(x - 1, 0); nx <= Math.min(x + 1, chunks.x - 1); nx += 1) {
+          fn(nx, nz);
+        }
+      }
+    };
+    const relightAround = (x, z) => forEachAround(x, z, (cx, cz) => {
+      if (importing.relit[cz * chunks.x + cx]) {
+        return;
+      }
+      let isReady = true;
+      forEachAround(cx, cz, (nx, nz) => {
+        if (remaining[nz * chunks.x + nx] !== 0) isReady = false;
+      });
+      if (!isReady) {
+        return;
+      }
+      importing.relit[cz * chunks.x + cx] = 1;
+      this._relightRegion(
+        world.address,
+        heightmap.address,
+        voxels.address,
+        dirty.address,
+        queueA.address,
+        cx * chunkSize,
+        (cx + 1) * chunkSize,
+        cz * chunkSize,
+        (cz + 1) * chunkSize
+      );
+    });
+    // The all-air columns are in already
+    for (let z = 0; z < chunks.z; z += 1) {
+      for (let x = 0; x < chunks.x; x += 1) {
+        if (remaining[z * chunks.x + x] === 0) relightAround(x, z);
+      }
+    }
+    let loaded = 0;
+    let total = 0;
+    const requests = [];
+    for (let i = 0; i < count; i += 1) {
+      if (savedChunks[i].length === 0) {
+        continue;
+      }
+      total += 1;
+      // The worker takes ownership of the buffer, so it gets a copy.
+      requests.push(
+        pako.request({ data: savedChunks[i].slice(), operation: 'inflate' })
+          .then((data) => {
+            if (this.importing !== importing) {
+              // Another chunk failed (or another import started)
+              return;
+            }
+            if (data.length !== chunk.view.length) {
+              throw new Error('The .blocks file has a corrupt chunk');
+            }
+            const x = i % chunks.x;
+            const y = Math.floor(i / chunks.x) % chunks.y;
+            const z = Math.floor(i / (chunks.x * chunks.y));
+            chunk.view.set(data);
+            this._importChunk(
+              world.address,
+              heightmap.address,
+              voxels.address,
+              x * chunkSize,
+              y * chunkSize,
+              z * chunkSize,
+              chunk.address
+            );
+            remaining[z * chunks.x + x] -= 1;
+            if (remaining[z * chunks.x + x] === 0) {
+              relightAround(x, z);
+            }
+            loaded += 1;
+            if (onProgress) {
+              onProgress(loaded, total);
+            }
+          })
+      );
+    }
+    return Promise.all(requests)
+      .then(() => {
+        this.importing = null;
+        this.checkQueues();
+        this.checkPool();
+        this.savedChunks = savedChunks;
+        unsaved.fill(0);
+        awake.view.fill(0xFFFFFFFF);
+      })
+      .catch((err) => {
+        if (this.importing === importing) {
+          this.importing = null;
+          heightmap.view.fill(0);
+          this.clearVoxels();
+          this.savedChunks = [];
+          unsaved.fill(0xFFFFFFFF);
+          dirty.view.fill(0xFFFFFFFF);
+          awake.view.fill(0xFFFFFFFF);
+        }
+        throw err;
+      });
+  }
+
+  importLegacyVoxels(deflated, relight) {
     const {
-      width,
-      height,
       depth,
+      world,
       heightmap,
       voxels,
+      slice,
+      queueA,
       pako,
     } = this;
     return pako.request({ data: deflated, operation: 'inflate' })
       .then((inflated) => {
-        // This should prolly be a method in the C implementation
-        for (let z = 0, index = 0; z < depth; z += 1) {
-          for (let x = 0; x < width; x += 1, index += 1) {
-            for (let y = height - 1; y >= 0; y -= 1) {
-              if (
-                y === 0
-                || inflated[(z * width * height + y * width + x) * 6] !== 0
-              ) {
-                heightmap.view[index] = y;
-                break;
-              }
-            }
-          }
+        this.clearVoxels();
+        for (let z = 0; z < depth; z += 1) {
+          slice.view.set(inflated.subarray(z * slice.view.length, (z + 1) * slice.view.length));
+          this._importVoxels(world.address, voxels.address, z, slice.address);
         }
-        voxels.view.set(inflated);
+        this._rebuildHeightmap(
+          world.address,
+          heightmap.address,
+          voxels.address,
+          queueA.address,
+          relight ? 1 : 0
+        );
+        this.checkQueues();
+        this.checkPool();
+        this.dirty.view.fill(0xFFFFFFFF);
+        this.awake.view.fill(0xFFFFFFFF);
+        this.unsaved.fill(0xFFFFFFFF);
       });
   }
 }
 
+VoxelWorld.fields = {
+  type: 0,
+  r: 1,
+  g: 2,
+  b: 3,
+  light: 4,
+  sunlight: 5,
+  stride: 6,
+};
+
+VoxelWorld.blocks = {
+  // v2 .blocks files are little endian:
+  // A header with the magic, version, width, height, depth and chunkSize (uint32),
+  // an index with the (offset, length) of every chunk in the same order as
+  // the dirty chunks (uint32) and then the data of every chunk: Their
+  // (type, r, g, b) voxels in z, y, x order, deflated. All-air chunks have no data.
+  magic: 0x324B4C42, // 'BLK2'
+  version: 2,
+  header: 6,
+};
+
+VoxelWorld.palette = {
+  chunkSize: 32,
+  // Sizes in 32bit words of the C structs
+  header: 20,
+  chunk: 8,
+};
+
+VoxelWorld.brushShapes = {
+  box: 0,
+  sphere: 1,
+};
+
+VoxelWorld.workerStackSize = 65536;
+
+// The worker arenas fit the worst case chunk this many times.
+// They mesh chunks until the next one could overflow it.
+VoxelWorld.workerArenaChunks = 2;
+
+// The size of the propagateParallel tiles. Two tiles in between
+// must be at least as wide as the maxLight of voxels.c (32) minus one,
+// plus the neighbours the flood reads.
+VoxelWorld.propagateTile = 32;
+
+VoxelWorld.generateFlags = {
+  interpolated: 1,
+};
+
+VoxelWorld.meshFlags = {
+  greedy: 1,
+  packed: 2,
+  sharedIndices: 4,
+};
+
+// Offsets of the ChunkSummary fields in core/voxels.c
+VoxelWorld.summaryFields = {
+  solid: 0,
+  faces: 1,
+  visibility: 7,
+  stride: 8,
+};
+
+// Must match the ChunkOccupancy enum in core/voxels.c
+VoxelWorld.occupancy = {
+  mixed: 0,
+  empty: 1,
+  solid: 2,
+  enclosed: 3,
+};
+
 export default VoxelWorld;
@@ -0,0 +1,124 @@
+let context;
+const ready = new Promise((resolve) => {
+  self.addEventListener('message', ({ data }) => {
+    if (data.type !== 'init') {
+      return;
+    }
+    const { memory, module, stack } = data;
+    WebAssembly.instantiate(module, { env: { memory } })
+      .then((instance) => {
+        instance.exports.__stack_pointer.value = stack;
+        context = { ...data, instance };
+        resolve();
+      })
+      .catch((e) => console.error(e));
+  });
+});
+
+const mesh = ({
+  x,
+  y,
+  z,
+  lod = 1,
+}, offset) => {
+  // Appends the chunk to the arena at the given face offset
+  const {
+    chunkSize,
+    meshFlags,
+    memory,
+    instance,
+    world,
+    voxels,
+    bounds,
+    indices,
+    vertices,
+    colors,
+  } = context;
+  const output = [
+    world,
+    voxels,
+    bounds,
+    indices + offset * 6 * 4,
+    vertices + offset * 4 * (meshFlags & 2 ? 4 : 8),
+    colors + offset * 4,
+    chunkSize,
+    x * chunkSize,
+    y * chunkSize,
+    z * chunkSize,
+  ];
+  const faces = lod > 1 ? (
+    instance.exports.meshLOD(...output, lod, meshFlags)
+  ) : (
+    instance.exports.mesh(...output, meshFlags)
+  );
+  if (faces === -1) {
+    throw new Error('Requested chunk is out of bounds');
+  }
+  const [bx, by, bz, radius] = new Float32Array(memory.buffer, bounds, 4);
+  return { bounds: [bx, by, bz, radius], faces, offset };
+};
+
+const generate = ({
+  seed,
+  type,
+  flags,
+  slabs,
+}) => {
+  const {
+    instance,
+    world,
+    heightmap,
+    voxels,
+  } = context;
+  // Every slab only writes its own voxels and heightmap rows
+  slabs.forEach(({ from, to }) => (
+    instance.exports.generateSlab(world, heightmap, voxels, seed, type, flags, from, to)
+  ));
+};
+
+const propagate = ({ pass, tiles }) => {
+  const {
+    instance,
+    world,
+    heightmap,
+    voxels,
+    queue,
+  } = context;
+  // The columns pass gets z slabs. The main thread runs the
+  // spill passes over tiles far enough apart from each other.
+  tiles.forEach(({ fromX, toX, fromZ, toZ }) => (
+    pass === 'columns' ? (
+      instance.exports.propagateColumns(world, voxels, fromZ, toZ)
+    ) : (
+      instance.exports.propagateSpill(world, heightmap, voxels, queue, fromX, toX, fromZ, toZ)
+    )
+  ));
+};
+
+self.addEventListener('message', ({ data }) => {
+  if (data.type === 'generate' || data.type === 'propagate') {
+    ready.then(() => {
+      if (data.type === 'generate') generate(data);
+      else propagate(data);
+      self.postMessage({ id: data.id });
+    });
+    return;
+  }
+  if (data.type !== 'mesh') {
+    return;
+  }
+  const { id, chunks, start } = data;
+  ready.then(() => {
+    // The output stays in the shared memory. The main thread reads it
+    // from there and asks for the rest of the chunks when it's done.
+    const { arenaFaces, maxFaces } = context;
+    const results = [];
+    let offset = 0;
+    for (let i = start; i < chunks.length && offset + maxFaces <= arenaFaces; i += 1) {
+      const result = mesh(chunks[i], offset);
+      results.push(result);
+      offset += result.faces;
+    }
+    self.postMessage({ id, start, results });
+  });
+});
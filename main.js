@@ -5,10 +5,17 @@ import VoxelWorld from './core/voxels.js';
 import Dome from './renderables/dome.js';
 import Grid from './renderables/grid.js';
 import VoxelChunk from './renderables/chunk.js';
-import { Color, Group, Scene } from './vendor/three.js';
+import {
+  Color,
+  Group,
+  Scene,
+  Vector3,
+} from './vendor/three.js';
 
 // Navigate to /#/animation to run the animation test
 const isAnimationTest = location.hash.substr(2) === 'animation';
+// Navigate to /#/streaming to walk an endless world
+const isStreamingTest = location.hash.substr(2) === 'streaming';
 
 const renderer = new Renderer({
   dom: {
@@ -62,7 +69,16 @@ const updateLight = (intensity) => {
 };
 
 const world = new VoxelWorld({
-  wasm: '/core/voxels.wasm',
+  wasm: {
+    default: '/core/voxels.wasm',
+    simd: '/core/voxels.simd.wasm',
+    threads: '/core/voxels.threads.wasm',
+    threadsSimd: '/core/voxels.threads.simd.wasm',
+  },
+  // The packed vertex format reads the face colors with texelFetch
+  packedVertices: renderer.renderer.capabilities.isWebGL2,
+  sharedIndices: true,
+  streaming: isStreamingTest,
   ...(isAnimationTest ? {
     width: 96,
     height: 320,
@@ -72,25 +88,29 @@ const world = new VoxelWorld({
     height: 128,
     depth: 384,
   }),
-  onLoad: () => {
-    const chunks = {
-      x: world.width / world.chunkSize,
-      y: world.height / world.chunkSize,
-      z: world.depth / world.chunkSize,
-    };
-    const origin = { x: world.width * 0.5 * scale, z: world.depth * 0.5 * scale };
-    const dome = new Dome(origin);
-    const grid = new Grid(origin);
+  onLoad: async () => {
+    const { chunks } = world;
+    const origin = { x: world.width * 0.5, z: world.depth * 0.5 };
+    const dome = new Dome({ x: origin.x * scale, z: origin.z * scale });
+    const grid = new Grid({ x: origin.x * scale, z: origin.z * scale });
     const voxels = new Group();
     voxels.matrixAutoUpdate = false;
     scene.add(grid);
     scene.add(voxels);
     scene.add(dome);
 
-    world.generate({
-      // type: Math.floor(Math.random() * 2),
-      simulation: isAnimationTest,
-    });
+    if (isStreamingTest) {
+      // The world is a window that follows the camera (see streamWorld)
+      world.startStreaming(origin, { interpolated: true });
+    } else {
+      // The noise gets interpolated from a coarse lattice
+      // and the slabs of the world are generated across the workers.
+      await world.generateParallel({
+        // type: Math.floor(Math.random() * 2),
+        simulation: isAnimationTest,
+        interpolated: true,
+      });
+    }
     if (isAnimationTest) {
       camera.position.set(
         world.width * 0.5 * scale,
@@ -115,60 +135,151 @@ const world = new VoxelWorld({
     for (let z = 0; z < chunks.z; z += 1) {
       for (let y = 0; y < chunks.y; y += 1) {
         for (let x = 0; x < chunks.x; x += 1) {
-          const chunk = new VoxelChunk({
+          const mesh = new VoxelChunk({
             x: x * world.chunkSize,
             y: y * world.chunkSize,
             z: z * world.chunkSize,
-            geometry: world.mesh(x, y, z),
             scale,
           });
-          meshes.push(chunk);
-          if (chunk.geometry.getIndex() !== null) {
-            voxels.add(chunk);
-          }
+          mesh.chunk = { x, y, z };
+          mesh.lod = 1;
+          meshes.push(mesh);
         }
       }
     }
+    const getMesh = ({ x, y, z }) => meshes[z * chunks.x * chunks.y + y * chunks.x + x];
+    // World voxel of the first voxel of the world memory.
+    // It only moves in the streaming test and everything else is relative to it.
+    const worldOrigin = new Vector3();
+    // The chunks further away from the camera get meshed at a lower level of detail.
+    // They get reassigned when the camera moves into another chunk.
+    const cameraChunk = new Vector3(-1, -1, -1);
+    const cameraVoxel = new Vector3();
+    // Only the chunks that can be seen from the camera chunk through the air get drawn.
+    // They get recomputed when the camera moves into another chunk and after remeshing.
+    const updateVisibility = () => {
+      const visible = world.getVisibleChunks(cameraVoxel);
+      meshes.forEach((mesh, i) => {
+        mesh.visible = !visible || visible[i] === 1;
+      });
+    };
+    const updateLOD = () => {
+      // Returns the chunks that need to be remeshed at their new level
+      cameraVoxel.copy(camera.position).divideScalar(scale).sub(worldOrigin);
+      const { x, y, z } = cameraVoxel;
+      const { chunkSize } = world;
+      if (cameraChunk.equals({
+        x: Math.floor(x / chunkSize),
+        y: Math.floor(y / chunkSize),
+        z: Math.floor(z / chunkSize),
+      })) {
+        return [];
+      }
+      cameraChunk.copy(cameraVoxel).divideScalar(chunkSize).floor();
+      updateVisibility();
+      return meshes.reduce((changed, mesh) => {
+        const lod = world.getLOD(mesh.chunk, cameraVoxel);
+        if (mesh.lod !== lod) {
+          mesh.lod = lod;
+          // The chunks waiting for their light get meshed once they're relit
+          if (!world.isRelightPending(mesh.chunk)) changed.push(mesh.chunk);
+        }
+        return changed;
+      }, []);
+    };
+    const updateChunk = (chunk, geometry) => {
+      const mesh = getMesh(chunk);
+      if (geometry.faces > 0) {
+        mesh.update(geometry);
+        if (!mesh.parent) voxels.add(mesh);
+      } else if (mesh.parent) {
+        voxels.remove(mesh);
+      }
+    };
+    // The chunks copy the geometries into their own buffers,
+    // so they can be read in place from the wasm memory.
+    const remesh = (chunk) => updateChunk(
+      chunk,
+      world.meshInPlace(chunk.x, chunk.y, chunk.z, getMesh(chunk).lod)
+    );
+    const remeshMany = (list) => world.meshMany(
+      list.map((chunk) => ({ ...chunk, lod: getMesh(chunk).lod })),
+      updateChunk
+    )
+      .then(updateVisibility);
+    const streamWorld = () => {
+      // Slides the world when the camera moves into another chunk. The meshes
+      // of the chunks that stay move along with them and the ones of the chunks
+      // that left get reused for the ones that came in.
+      // The light of the chunks it brings in gets recomputed over the next frames.
+      // Returns the chunks that need to be remeshed.
+      const shift = world.stream(cameraVoxel.copy(camera.position).divideScalar(scale));
+      if (!shift) {
+        return world.relightStreamed() ? world.getDirtyChunks() : [];
+      }
+      const { chunkSize } = world;
+      const isInside = (x, z) => x >= 0 && x < chunks.x && z >= 0 && z < chunks.z;
+      const previous = meshes.slice();
+      const recycled = previous.filter(({ chunk }) => !isInside(chunk.x - shift.x, chunk.z - shift.z));
+      for (let z = 0, i = 0; z < chunks.z; z += 1) {
+        for (let y = 0; y < chunks.y; y += 1) {
+          for (let x = 0; x < chunks.x; x += 1, i += 1) {
+            let mesh;
+            if (isInside(x + shift.x, z + shift.z)) {
+              mesh = previous[(z + shift.z) * chunks.x * chunks.y + y * chunks.x + x + shift.x];
+            } else {
+              mesh = recycled.pop();
+              if (mesh.parent) voxels.remove(mesh);
+            }
+            mesh.chunk = { x, y, z };
+            mesh.position.set(x, y, z).multiplyScalar(chunkSize * scale);
+            mesh.updateMatrix();
+            meshes[i] = mesh;
+          }
+        }
+      }
+      worldOrigin.set(world.origin.x, 0, world.origin.z);
+      voxels.position.copy(worldOrigin).multiplyScalar(scale);
+      voxels.updateMatrix();
+      [dome, grid].forEach((mesh) => {
+        mesh.position.set(worldOrigin.x + origin.x, 0, worldOrigin.z + origin.z).multiplyScalar(scale);
+        mesh.updateMatrix();
+      });
+      // The camera is in another chunk of the world now
+      cameraChunk.set(-1, -1, -1);
+      return world.getDirtyChunks();
+    };
+    updateLOD();
+    remeshMany(world.getDirtyChunks());
+
+    // The workers read the voxels while meshing, so anything that
+    // writes to them (simulation, edits, imports) waits for this.
+    let isMeshing = false;
 
     if (isAnimationTest) {
       // Animation Test
       let t = 0;
       scene.onAnimationTick = ({ delta }) => {
+        // The workers read the voxels while meshing,
+        // so the simulation waits for them to finish.
+        if (isMeshing) {
+          return;
+        }
         t += delta;
         if (t >= 5) {
           t = 0;
-          world.generate({ simulation: true });
+          world.generate({ simulation: true, interpolated: true });
         } else {
           world.simulate(1);
         }
-        for (let z = 0, i = 0; z < chunks.z; z += 1) {
-          for (let y = 0; y < chunks.y; y += 1) {
-            for (let x = 0; x < chunks.x; x += 1, i += 1) {
-              const mesh = meshes[i];
-              const geometry = world.mesh(x, y, z);
-              if (geometry.indices.length > 0) {
-                mesh.update(geometry);
-                if (!mesh.parent) voxels.add(mesh);
-              } else if (mesh.parent) {
-                voxels.remove(mesh);
-              }
-            }
-          }
-        }
+        isMeshing = true;
+        remeshMany([...world.getDirtyChunks(), ...updateLOD()]).then(() => {
+          isMeshing = false;
+        });
       };
     } else {
       // Block editing
-      const neighbors = [
-        { x: -1, z: -1 },
-        { x: 0, z: -1 },
-        { x: 1, z: -1 },
-        { x: -1, z: 0 },
-        { x: 0, z: 0 },
-        { x: 1, z: 0 },
-        { x: -1, z: 1 },
-        { x: 0, z: 1 },
-        { x: 1, z: 1 },
-      ];
+      const rayOrigin = new Vector3();
       scene.onAnimationTick = ({ delta }) => {
         const { brush, buttons, raycaster } = controls;
         if (buttons.toggleDown) {
@@ -180,6 +291,21 @@ const world = new VoxelWorld({
           updateLight(light + Math.min(Math.max(targetLight - light, -s), s));
         }
 
+        // The workers read the voxels while meshing,
+        // so the edits wait for them to finish.
+        if (isMeshing) {
+          return;
+        }
+        const changes = [...(isStreamingTest ? streamWorld() : []), ...updateLOD()];
+        if (changes.length) {
+          isMeshing = true;
+          // A chunk can be both dirty and at a new level
+          remeshMany([...new Set(changes.map(getMesh))].map(({ chunk }) => chunk)).then(() => {
+            isMeshing = false;
+          });
+          return;
+        }
+
         // Process input
         const isPlacingBlock = buttons.secondaryDown;
         const isPlacingLight = buttons.tertiaryDown;
@@ -187,10 +313,35 @@ const world = new VoxelWorld({
         if (!(isPlacingBlock || isPlacingLight || isRemoving)) {
           return;
         }
-        const hit = raycaster.intersectObjects(
-          isRemoving ? voxels.children : [...voxels.children, grid]
-        )[0] || false;
-        if (!hit) {
+        // Blocks are picked by walking the voxels with the ray,
+        // so it also works for chunks that haven't been remeshed yet.
+        // The grid is only tested when placing and the ray hits no block.
+        const { ray } = raycaster;
+        const hit = world.raycast({
+          origin: rayOrigin.copy(ray.origin).divideScalar(scale).sub(worldOrigin),
+          direction: ray.direction,
+          maxDistance: raycaster.far / scale,
+        });
+        let point;
+        if (hit) {
+          // The normal is zero when the ray starts inside a block,
+          // there's no empty face to place against in that case.
+          if (!isRemoving && hit.normal.x === 0 && hit.normal.y === 0 && hit.normal.z === 0) {
+            return;
+          }
+          point = rayOrigin.copy(hit.position);
+          if (!isRemoving) point.add(hit.normal);
+        } else if (!isRemoving) {
+          const [gridHit] = raycaster.intersectObject(grid);
+          if (gridHit) {
+            point = gridHit.point
+              .divideScalar(scale)
+              .sub(worldOrigin)
+              .addScaledVector(gridHit.face.normal, 0.25)
+              .floor();
+          }
+        }
+        if (!point) {
           return;
         }
         if (sounds) {
@@ -198,84 +349,58 @@ const world = new VoxelWorld({
           if (sound && sound.context.state === 'running') {
             sound.filter.type = isRemoving ? 'highpass' : 'lowpass';
             sound.filter.frequency.value = (Math.random() + 0.5) * 1000;
-            sound.position.copy(hit.point);
+            sound.position.copy(point).add(worldOrigin).addScalar(0.5).multiplyScalar(scale);
             sound.play();
           }
         }
-        const color = {
-          r: Math.floor(Math.random() * 256),
-          g: Math.floor(Math.random() * 256),
-          b: Math.floor(Math.random() * 256),
-        };
-        const noise = ((color.r + color.g + color.b) / 3) * brush.noise;
-        hit.point
-          .divideScalar(scale)
-          .addScaledVector(hit.face.normal, isRemoving ? -0.25 : 0.25)
-          .floor();
         brush.shape = isPlacingLight ? 0 : 1;
         brush.size = isPlacingLight ? 2 : 6;
         let type;
         if (isPlacingBlock) type = 1;
         else if (isPlacingLight) type = 2;
         else type = 0;
-        controls.getBrush(brush).forEach(({ x, y, z }) => (
-          world.update({
-            x: hit.point.x + x,
-            y: hit.point.y + y,
-            z: hit.point.z + z,
-            type,
-            r: Math.min(Math.max(color.r + (Math.random() - 0.5) * noise, 0), 0xFF),
-            g: Math.min(Math.max(color.g + (Math.random() - 0.5) * noise, 0), 0xFF),
-            b: Math.min(Math.max(color.b + (Math.random() - 0.5) * noise, 0), 0xFF),
-          })
-        ));
-        const chunkX = Math.floor(hit.point.x / world.chunkSize);
-        const chunkY = Math.floor(hit.point.y / world.chunkSize);
-        const chunkZ = Math.floor(hit.point.z / world.chunkSize);
-        const topY = Math.min(chunkY + 1, chunks.y - 1);
-        neighbors.forEach((neighbor) => {
-          const x = chunkX + neighbor.x;
-          const z = chunkZ + neighbor.z;
-          if (x < 0 || x >= chunks.x || z < 0 || z >= chunks.z) {
-            return;
-          }
-          for (let y = 0; y <= topY; y += 1) {
-            const mesh = meshes[z * chunks.x * chunks.y + y * chunks.x + x];
-            const geometry = world.mesh(x, y, z);
-            if (geometry.indices.length > 0) {
-              mesh.update(geometry);
-              if (!mesh.parent) voxels.add(mesh);
-            } else if (mesh.parent) {
-              voxels.remove(mesh);
-            }
-          }
+        world.brush({
+          ...brush,
+          ...point,
+          type,
+          color: {
+            r: Math.floor(Math.random() * 256),
+            g: Math.floor(Math.random() * 256),
+            b: Math.floor(Math.random() * 256),
+          },
         });
+        world.getDirtyChunks().forEach(remesh);
+        updateVisibility();
       };
     }
 
     // Import by drag&drop or clicking the link on the info overlay
     {
       const importFile = (file) => {
+        if (isMeshing) {
+          setTimeout(() => importFile(file), 100);
+          return;
+        }
+        // Holding the flag for the whole import also
+        // stops the edits and the simulation meanwhile.
+        isMeshing = true;
         const reader = new FileReader();
         reader.onload = () => {
-          world.importVoxels(new Uint8Array(reader.result))
-            .then(() => {
-              for (let z = 0, i = 0; z < chunks.z; z += 1) {
-                for (let y = 0; y < chunks.y; y += 1) {
-                  for (let x = 0; x < chunks.x; x += 1, i += 1) {
-                    const mesh = meshes[i];
-                    const geometry = world.mesh(x, y, z);
-                    if (geometry.indices.length > 0) {
-                      mesh.update(geometry);
-                      if (!mesh.parent) voxels.add(mesh);
-                    } else if (mesh.parent) {
-                      voxels.remove(mesh);
-                    }
-                  }
-                }
-              }
+          // The chunks get meshed as they get their light and the rest
+          // once the whole world is in. A corrupt file leaves it empty,
+          // so that gets remeshed too.
+          world.importVoxels(new Uint8Array(reader.result), {
+            onProgress: () => world.getDirtyChunks().forEach(remesh),
+          })
+            .catch((e) => console.error(e))
+            .then(() => remeshMany(world.getDirtyChunks()))
+            .finally(() => {
+              isMeshing = false;
             });
         };
+        reader.onerror = () => {
+          isMeshing = false;
+        };
         reader.readAsArrayBuffer(file);
       };
       document.addEventListener('dragover', (e) => e.preventDefault(), false);
@@ -8,12 +8,62 @@
 # Also, make sure you downloaded the vendor submodules with: "git submodule init && git submodule update"
 # and remember to run "make -j8" on ../vendor/wasi-libc/ before running this.
 #
-clang --target=wasm32-unknown-wasi -nostartfiles --sysroot=vendor/wasi-libc/sysroot -O3 -flto \
--Wl,--import-memory -Wl,--lto-O3 -Wl,--no-entry \
+# Extra compiler flags can be passed through CFLAGS. For example:
+# CFLAGS="-DVOXELS_PLANAR=1" ./make.sh
+# builds with the planar voxel storage layout and
+# CFLAGS="-DVOXELS_PALETTE=1" ./make.sh
+# builds with the palette compressed one (see core/voxels.c).
+#
+EXPORTS="\
 -Wl,--export=__heap_base \
+-Wl,--export=getLayout \
+-Wl,--export=exportVoxels \
+-Wl,--export=importVoxels \
+-Wl,--export=exportChunk \
+-Wl,--export=importChunk \
+-Wl,--export=relight \
+-Wl,--export=rebuildHeightmap \
+-Wl,--export=shiftVoxels \
+-Wl,--export=clearRegion \
+-Wl,--export=relightRegion \
 -Wl,--export=mesh \
+-Wl,--export=meshLOD \
+-Wl,--export=getOccupancy \
 -Wl,--export=generate \
+-Wl,--export=generateSlab \
+-Wl,--export=generateRegion \
 -Wl,--export=propagate \
+-Wl,--export=propagateColumns \
+-Wl,--export=propagateSpill \
+-Wl,--export=raycast \
 -Wl,--export=simulate \
 -Wl,--export=update \
--o core/voxels.wasm core/voxels.c
+-Wl,--export=updateBatch \
+-Wl,--export=brush"
+
+build() {
+  OUTPUT=$1
+  shift
+  clang --target=wasm32-unknown-wasi -nostartfiles --sysroot=vendor/wasi-libc/sysroot -O3 -flto \
+  -Wl,--import-memory -Wl,--lto-O3 -Wl,--no-entry \
+  $EXPORTS \
+  $CFLAGS \
+  "$@" \
+  -o $OUTPUT core/voxels.c
+}
+
+THREADS="\
+-matomics -mbulk-memory \
+-Wl,--shared-memory -Wl,--max-memory=2147483648 \
+-Wl,--export=__stack_pointer"
+
+build core/voxels.wasm
+# SIMD build. VoxelWorld picks it when the runtime supports wasm SIMD.
+build core/voxels.simd.wasm -msimd128
+# Threaded builds for the meshing workers.
+# They import a shared memory and export the stack pointer so each worker
+# instance can run on its own stack. Browsers will only use them when the page
+# is cross-origin isolated (COOP/COEP headers), otherwise they fall back to
+# the builds above.
+build core/voxels.threads.wasm $THREADS
+build core/voxels.threads.simd.wasm $THREADS -msimd128
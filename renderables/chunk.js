@@ -2,9 +2,12 @@ import {
   BufferGeometry,
   Mesh,
   BufferAttribute,
+  DataTexture,
+  DynamicDrawUsage,
   InterleavedBuffer,
   InterleavedBufferAttribute,
   ShaderLib,
+  RGBAFormat,
   ShaderMaterial,
   Sphere,
   UniformsUtils,
@@ -41,6 +44,47 @@ class VoxelChunk extends Mesh {
       fragmentShader,
       vertexColors: true,
     });
+    // The packed vertex format (VoxelWorld packedVertices option) needs WebGL2.
+    // Every vertex is 4 bytes: the position in the low 6 bits of the first 3,
+    // the light split in their top 2 bits, and the sunlight + AO level in the 4th.
+    // The face colors come from a texture indexed by gl_VertexID.
+    // It shares the uniforms so the light intensities stay in sync.
+    VoxelChunk.packedMaterial = new ShaderMaterial({
+      uniforms: {
+        ...VoxelChunk.material.uniforms,
+        colors: { value: null },
+      },
+      vertexShader: vertexShader
+        .replace(
+          '#include <common>',
+          [
+            'attribute float lighting;',
+            'uniform float ambientIntensity;',
+            'uniform float lightIntensity;',
+            'uniform float sunlightIntensity;',
+            'uniform sampler2D colors;',
+            '#include <common>',
+          ].join('\n')
+        )
+        .replace(
+          '#include <color_vertex>',
+          [
+            'int face = gl_VertexID / 4;',
+            'vec3 lightBits = floor(position / 64.0);',
+            'float light = (lightBits.x + lightBits.y * 4.0 + lightBits.z * 16.0) / 63.0;',
+            'float sunlight = mod(lighting, 64.0) / 63.0;',
+            'float ao = floor(lighting / 64.0) * 20.0 / 255.0;',
+            'vColor.xyz = texelFetch(colors, ivec2(face % 256, face / 256), 0).xyz * (1.0 - ao);',
+            'vColor.xyz *= clamp(pow(light, 2.0) * lightIntensity + pow(sunlight, 2.0) * sunlightIntensity, ambientIntensity, 1.0);',
+          ].join('\n')
+        )
+        .replace(
+          '#include <begin_vertex>',
+          'vec3 transformed = mod(position, 64.0);'
+        ),
+      fragmentShader,
+      vertexColors: true,
+    });
   }
 
   constructor({
@@ -52,7 +96,7 @@ class VoxelChunk extends Mesh {
       VoxelChunk.setupMaterial();
     }
     super(new BufferGeometry(), VoxelChunk.material);
-    if (geometry.indices.length > 0) {
+    if (geometry && geometry.faces > 0) {
       this.update(geometry);
     }
     this.position.set(x, y, z).multiplyScalar(scale);
@@ -61,22 +105,116 @@ class VoxelChunk extends Mesh {
     this.matrixAutoUpdate = false;
   }
 
-  update({ bounds, indices, vertices }) {
+  static getQuadIndices(faces) {
+    // Index buffer shared by all the chunks meshed with the sharedIndices flag.
+    // It only grows (to the next power of two of faces), so the chunks that
+    // still hold a previous one can keep drawing with it.
+    const { quadIndices } = VoxelChunk;
+    if (quadIndices && quadIndices.count >= faces * 6) {
+      return quadIndices;
+    }
+    const size = 2 ** Math.ceil(Math.log2(Math.max(faces, 1024)));
+    const indices = new ((size * 4 - 1) <= 65535 ? Uint16Array : Uint32Array)(size * 6);
+    for (let face = 0, index = 0, vertex = 0; face < size; face += 1, index += 6, vertex += 4) {
+      indices[index] = vertex;
+      indices[index + 1] = vertex + 1;
+      indices[index + 2] = vertex + 2;
+      indices[index + 3] = vertex + 2;
+      indices[index + 4] = vertex + 3;
+      indices[index + 5] = vertex;
+    }
+    VoxelChunk.quadIndices = new BufferAttribute(indices, 1);
+    return VoxelChunk.quadIndices;
+  }
+
+  update({
+    bounds,
+    colors,
+    faces,
+    indices,
+    vertices,
+  }) {
+    // The chunk keeps its own buffers and only reallocates them when they need
+    // to grow, so remeshing copies and uploads just the range that's in use.
     const { geometry } = this;
-    vertices = new InterleavedBuffer(vertices, 8);
-    geometry.setIndex(new BufferAttribute(indices, 1));
-    geometry.setAttribute('position', new InterleavedBufferAttribute(vertices, 3, 0));
-    geometry.setAttribute('color', new InterleavedBufferAttribute(vertices, 3, 3));
-    geometry.setAttribute('light', new InterleavedBufferAttribute(vertices, 2, 6));
+    const stride = colors ? 4 : 8;
+    if (!this.vertices || this.capacity < faces || this.stride !== stride) {
+      this.allocate(faces, stride, !!indices);
+    }
+    this.vertices.array.set(vertices.subarray(0, faces * 4 * stride));
+    this.vertices.updateRange.count = faces * 4 * stride;
+    this.vertices.needsUpdate = true;
+    if (indices) {
+      this.indices.array.set(indices.subarray(0, faces * 6));
+      this.indices.updateRange.count = faces * 6;
+      this.indices.needsUpdate = true;
+    } else {
+      geometry.setIndex(VoxelChunk.getQuadIndices(faces));
+    }
+    if (colors) {
+      this.colors.image.data.set(colors.subarray(0, faces * 4));
+      this.colors.needsUpdate = true;
+    }
+    geometry.setDrawRange(0, faces * 6);
     if (geometry.boundingSphere === null) {
       geometry.boundingSphere = new Sphere();
     }
     geometry.boundingSphere.set({ x: bounds[0], y: bounds[1], z: bounds[2] }, bounds[3]);
   }
 
-  dispose() {
+  allocate(faces, stride, hasIndices) {
+    this.dispose();
     const { geometry } = this;
+    // Rounded up to a power of two (and to complete rows of the colors texture)
+    const capacity = 2 ** Math.ceil(Math.log2(Math.max(faces, 256)));
+    const vertices = new InterleavedBuffer(new Uint8Array(capacity * 4 * stride), stride);
+    vertices.setUsage(DynamicDrawUsage);
+    geometry.setAttribute('position', new InterleavedBufferAttribute(vertices, 3, 0));
+    if (stride === 4) {
+      // Packed format: see packedMaterial
+      geometry.deleteAttribute('color');
+      geometry.deleteAttribute('light');
+      geometry.setAttribute('lighting', new InterleavedBufferAttribute(vertices, 1, 3));
+      this.colors = new DataTexture(new Uint8Array(capacity * 4), 256, capacity / 256, RGBAFormat);
+      if (this.material !== VoxelChunk.packedMaterial) {
+        this.material = VoxelChunk.packedMaterial;
+        // The material is shared, so every chunk binds its colors before rendering
+        this.onBeforeRender = (renderer, scene, camera, geometry, material) => {
+          material.uniforms.colors.value = this.colors;
+          material.uniformsNeedUpdate = true;
+        };
+      }
+    } else {
+      geometry.deleteAttribute('lighting');
+      geometry.setAttribute('color', new InterleavedBufferAttribute(vertices, 3, 3));
+      geometry.setAttribute('light', new InterleavedBufferAttribute(vertices, 2, 6));
+    }
+    if (hasIndices) {
+      this.indices = new BufferAttribute(
+        new ((capacity * 4 - 1) <= 65535 ? Uint16Array : Uint32Array)(capacity * 6),
+        1
+      );
+      this.indices.setUsage(DynamicDrawUsage);
+      geometry.setIndex(this.indices);
+    }
+    this.capacity = capacity;
+    this.stride = stride;
+    this.vertices = vertices;
+  }
+
+  dispose() {
+    const { colors, geometry, indices } = this;
+    if (geometry.index !== indices) {
+      // Disposing the geometry would also delete the shared index buffer
+      geometry.setIndex(null);
+    }
     geometry.dispose();
+    if (colors) {
+      colors.dispose();
+    }
+    delete this.colors;
+    delete this.indices;
+    delete this.vertices;
   }
 }
 